@@ -0,0 +1,27 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Monotonic wall clock in nanoseconds */
+static inline uint64_t bench_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Operations per second of [ops] done in [ns] nanoseconds */
+static inline double bench_rate(uint64_t ops, uint64_t ns) {
+	return ns ? ops * 1e9 / ns : 0;
+}
+
+/* Scheduler API before per-CPU run queues, for timing older trees */
+#ifdef SCHED_SINGLE_RQ
+#define init_scheduler(n)	init_scheduler()
+#define finish_scheduler()
+#define get_proc(cpu)		get_proc()
+#define put_proc(cpu, p)	put_proc(p)
+#endif
+
+#endif
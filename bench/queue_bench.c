@@ -0,0 +1,79 @@
+/*
+ * Run queue stress test
+ * Pushes NR_PROCS PCBs through the queue of one priority level, first
+ * filling it and draining it again, then keeping it full while one
+ * process leaves for every one that arrives. Every PCB has to come
+ * out in the order it went in.
+ */
+
+#include "queue.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NR_PROCS 100000
+#define NR_ROUNDS 10
+
+static int check(struct pcb_t * proc, struct pcb_t * want) {
+	if (proc != want) {
+		fprintf(stderr, "queue_bench: got pid %d, expected pid %d\n",
+			proc ? (int)proc->pid : -1, (int)want->pid);
+		return -1;
+	}
+	return 0;
+}
+
+int main(void) {
+	struct queue_t q = {0};
+	struct pcb_t * procs = calloc(NR_PROCS, sizeof(struct pcb_t));
+	uint64_t start, ns;
+	long ops;
+	int i, r;
+
+	for (i = 0; i < NR_PROCS; i++) {
+		procs[i].pid = i + 1;
+#ifdef MLQ_SCHED
+		procs[i].prio = 0;
+#endif
+	}
+
+	/* Fill the level with every PCB, then drain it */
+	ops = 0;
+	start = bench_now_ns();
+	for (r = 0; r < NR_ROUNDS; r++) {
+		for (i = 0; i < NR_PROCS; i++)
+			enqueue(&q, &procs[i]);
+		for (i = 0; i < NR_PROCS; i++)
+			if (check(dequeue(&q), &procs[i]))
+				return 1;
+		ops += 2 * NR_PROCS;
+	}
+	ns = bench_now_ns() - start;
+	printf("fill/drain %d PCBs x %d: %.0f ops/s\n", NR_PROCS, NR_ROUNDS,
+		bench_rate(ops, ns));
+
+	/* Keep NR_PROCS queued, one out for each one in */
+	for (i = 0; i < NR_PROCS; i++)
+		enqueue(&q, &procs[i]);
+	ops = 0;
+	start = bench_now_ns();
+	for (r = 0; r < NR_ROUNDS; r++) {
+		for (i = 0; i < NR_PROCS; i++) {
+			if (check(dequeue(&q), &procs[i]))
+				return 1;
+			enqueue(&q, &procs[i]);
+		}
+		ops += 2 * NR_PROCS;
+	}
+	ns = bench_now_ns() - start;
+	printf("steady %d PCBs queued x %d: %.0f ops/s\n", NR_PROCS, NR_ROUNDS,
+		bench_rate(ops, ns));
+
+	if (q.size != NR_PROCS) {
+		fprintf(stderr, "queue_bench: %d PCBs left, expected %d\n", q.size, NR_PROCS);
+		return 1;
+	}
+	free_queue(&q);
+	free(procs);
+	return 0;
+}
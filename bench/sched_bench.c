@@ -0,0 +1,51 @@
+/*
+ * Dispatcher microbenchmark
+ * One CPU keeps taking the next process with get_proc() and handing it
+ * back with put_proc(), as cpu_routine() does at the end of a time
+ * slice. Runnable processes are spread over the priority levels, so a
+ * dispatcher that scans the levels pays for every empty one.
+ *
+ * Build with -DSCHED_SINGLE_RQ to time trees from before the per-CPU
+ * run queues, whose scheduler calls take no CPU argument.
+ */
+
+#include "sched.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NR_DISPATCH 2000000
+
+int main(int argc, char * argv[]) {
+	int nprocs[] = {1, 8, 64, MAX_PRIO};
+	int n, i, k;
+	long iters = (argc > 1) ? atol(argv[1]) : NR_DISPATCH;
+
+	printf("%8s %16s\n", "procs", "dispatches/s");
+	for (n = 0; n < (int)(sizeof(nprocs) / sizeof(nprocs[0])); n++) {
+		struct pcb_t * procs = calloc(nprocs[n], sizeof(struct pcb_t));
+		uint64_t start, ns;
+
+		init_scheduler(1);
+		for (i = 0; i < nprocs[n]; i++) {
+			procs[i].pid = i + 1;
+#ifdef MLQ_SCHED
+			procs[i].prio = i * MAX_PRIO / nprocs[n];
+#endif
+			procs[i].priority = i;
+			add_proc(&procs[i]);
+		}
+
+		start = bench_now_ns();
+		for (k = 0; k < iters; k++) {
+			struct pcb_t * proc = get_proc(0);
+			put_proc(0, proc);
+		}
+		ns = bench_now_ns() - start;
+
+		printf("%8d %16.0f\n", nprocs[n], bench_rate(iters, ns));
+		finish_scheduler();
+		free(procs);
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Dispatcher scaling benchmark
+ * One thread per simulated CPU takes a process with get_proc() and
+ * hands it back with put_proc() for a fixed wall time, as
+ * cpu_routine() does every time slice. There are two runnable
+ * processes per CPU, spread over the priority levels. The CPU count
+ * goes from 1 to MAX_CPUS, and the total dispatches/s is printed for
+ * each.
+ *
+ * Build with -DSCHED_SINGLE_RQ to time trees from before the per-CPU
+ * run queues.
+ */
+
+#include "sched.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_CPUS 64
+#define RUN_MS 200
+
+struct cpu_arg {
+	int id;
+	long dispatches;
+	char pad[64];	// Keep counters of different CPUs off one cache line
+};
+
+static pthread_barrier_t start_barrier;
+static int stop;
+
+static void * cpu_loop(void * arg) {
+	struct cpu_arg * cpu = (struct cpu_arg *)arg;
+	long n = 0;
+
+	pthread_barrier_wait(&start_barrier);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		struct pcb_t * proc = get_proc(cpu->id);
+		if (proc == NULL)
+			continue;
+		put_proc(cpu->id, proc);
+		n++;
+	}
+	cpu->dispatches = n;
+	return NULL;
+}
+
+int main(int argc, char * argv[]) {
+	int run_ms = (argc > 1) ? atoi(argv[1]) : RUN_MS;
+	int ncpus, i;
+
+	printf("%6s %16s %16s\n", "cpus", "dispatches/s", "per cpu");
+	for (ncpus = 1; ncpus <= MAX_CPUS; ncpus *= 2) {
+		int nprocs = 2 * ncpus;
+		struct pcb_t * procs = calloc(nprocs, sizeof(struct pcb_t));
+		struct cpu_arg * cpus = calloc(ncpus, sizeof(struct cpu_arg));
+		pthread_t * tids = malloc(ncpus * sizeof(pthread_t));
+		struct timespec run = {run_ms / 1000, (run_ms % 1000) * 1000000L};
+		uint64_t start, ns;
+		long total = 0;
+
+		init_scheduler(ncpus);
+		for (i = 0; i < nprocs; i++) {
+			procs[i].pid = i + 1;
+#ifdef MLQ_SCHED
+			procs[i].prio = i * MAX_PRIO / nprocs;
+#endif
+			procs[i].priority = i;
+			add_proc(&procs[i]);
+		}
+
+		stop = 0;
+		pthread_barrier_init(&start_barrier, NULL, ncpus + 1);
+		for (i = 0; i < ncpus; i++) {
+			cpus[i].id = i;
+			pthread_create(&tids[i], NULL, cpu_loop, &cpus[i]);
+		}
+		pthread_barrier_wait(&start_barrier);
+		start = bench_now_ns();
+		nanosleep(&run, NULL);
+		__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+		for (i = 0; i < ncpus; i++) {
+			pthread_join(tids[i], NULL);
+			total += cpus[i].dispatches;
+		}
+		ns = bench_now_ns() - start;
+		pthread_barrier_destroy(&start_barrier);
+
+		printf("%6d %16.0f %16.0f\n", ncpus, bench_rate(total, ns),
+			bench_rate(total, ns) / ncpus);
+		finish_scheduler();
+		free(tids);
+		free(cpus);
+		free(procs);
+	}
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Tick engine benchmark
+ * Attaches N devices to the timer, each on its own thread, and lets
+ * every one of them call next_slot() for NR_SLOTS slots before it
+ * detaches, like a CPU whose process never stops running. Prints
+ * slots/s for N = 1, 2, 4, ..., MAX_DEVS.
+ *
+ * The timer only starts once per process, so every device count runs
+ * in its own child. The "Time slot" lines go to /dev/null.
+ */
+
+#include "timer.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_DEVS 64
+#define NR_SLOTS 10000
+
+static int nr_slots;
+
+static void * dev_loop(void * arg) {
+	struct timer_id_t * timer_id = (struct timer_id_t *)arg;
+	int i;
+
+	for (i = 0; i < nr_slots; i++)
+		next_slot(timer_id);
+	detach_event(timer_id);
+	return NULL;
+}
+
+static void run(int ndevs, int out) {
+	struct timer_id_t ** ids = malloc(ndevs * sizeof(struct timer_id_t *));
+	pthread_t * tids = malloc(ndevs * sizeof(pthread_t));
+	uint64_t start, ns;
+	int i;
+
+	for (i = 0; i < ndevs; i++)
+		ids[i] = attach_event();
+	start_timer();
+	start = bench_now_ns();
+	for (i = 0; i < ndevs; i++)
+		pthread_create(&tids[i], NULL, dev_loop, ids[i]);
+	for (i = 0; i < ndevs; i++)
+		pthread_join(tids[i], NULL);
+	ns = bench_now_ns() - start;
+	stop_timer();
+
+	dprintf(out, "%6d %12.0f\n", ndevs, bench_rate(nr_slots, ns));
+}
+
+int main(int argc, char * argv[]) {
+	int out = dup(STDOUT_FILENO);
+	int ndevs;
+
+	nr_slots = (argc > 1) ? atoi(argv[1]) : NR_SLOTS;
+
+	printf("%6s %12s\n", "devs", "slots/s");
+	fflush(stdout);
+	for (ndevs = 1; ndevs <= MAX_DEVS; ndevs *= 2) {
+		pid_t pid = fork();
+
+		if (pid == 0) {
+			if (freopen("/dev/null", "w", stdout) == NULL)
+				_exit(1);
+			run(ndevs, out);
+			_exit(0);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	return 0;
+}
@@ -78,6 +78,9 @@ struct pcb_t {
 #endif
 #ifdef CPU_TLB
 	struct memphy_struct *tlb;
+	uint32_t tlb_gen; // Bumped to flush every TLB entry of the process
+	unsigned long tlb_cpus; // CPUs whose TLB may hold its entries, bit (cpu % BITS_PER_LONG)
+	int tlb_active; // Running, its TLB hits bypass its mm lock
 #endif
 #ifdef MM_PAGING
 	struct mm_struct *mm;
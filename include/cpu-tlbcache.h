@@ -4,20 +4,42 @@
 #include "mm.h"
 
 // Forward declarations for functions
-int tlb_cache_read(struct memphy_struct *tlb, int pid, int pgnum, int* value);
-int tlb_cache_write(struct memphy_struct *tlb, int pid, int pgnum, int value);
+int tlb_cache_read(struct memphy_struct *tlb, int pid, int gen, int pgnum, int* value);
+int tlb_cache_write(struct memphy_struct *tlb, int pid, int gen, int pgnum, int value);
 int tlb_cache_invalidate(struct memphy_struct *tlb, int pid, int pgnum);
 int TLBMEMPHY_dump(struct memphy_struct *mp);
 int init_tlbmemphy(struct memphy_struct *mp, int max_size);
+int free_tlbmemphy(struct memphy_struct *mp);
+int tlb_policy_by_name(const char *name);
+int tlb_set_policy(struct memphy_struct *tlb, int policy);
+int tlb_cache_stat(struct memphy_struct *tlb);
+
+/* Modelled lookup latency in cycles of each TLB level and of a page
+ * table walk, used to report the average cost of a translation */
+#define TLB_L1_LATENCY   1
+#define TLB_L2_LATENCY   7
+#define TLB_WALK_LATENCY 30
+
+/* Shootdowns a TLB buffers before it falls back to a full flush */
+#define TLB_SHOOTDOWN_BATCH 32
+
+/* TLB replacement policies */
+#define TLB_REPL_RANDOM 0
+#define TLB_REPL_LRU    1
+#define TLB_REPL_CLOCK  2
 
 //TLB FEATURES:
-//FULLY-ASSOC
-//RANDOM REPLACEMENT
+//SET-ASSOC, CPUTLB_NWAYS WAYS PER SET (0 = FULLY-ASSOC)
+//SET INDEX = HASH OF PID AND PAGE NUMBER
+//REPLACEMENT WITHIN A SET: RANDOM, LRU OR CLOCK (SECOND-CHANCE)
 
 /* TLB Entry BIT */
 //FILLER BITS TO GET TO 64 BITS PER ENTRY
 #define FREE_HIBIT 63
-#define FREE_LOBIT 60
+#define FREE_LOBIT 61
+
+//REFERENCED SINCE THE CLOCK HAND LAST PASSED, CARVED FROM THE FREE BITS
+#define REF_BIT 60
 
 //ENTRY IS BEING USED OR NOT
 #define VALID_BIT 59
@@ -26,12 +48,17 @@ int init_tlbmemphy(struct memphy_struct *mp, int max_size);
 //FOR WRITE-BACK CHECK WHEN ENTRY IS REPLACED
 // #define DIRTY_BIT 58
 
-//FULLY-ASSOC, TAG BIT = PGN BIT = 14
+//TAG KEEPS THE FULL PGN SO ANY SET MAPPING WORKS, TAG BIT = PGN BIT = 14
 #define TAG_HIBIT 58
 #define TAG_LOBIT 45
 
-//PID BIT = 32
-#define PID_HIBIT 44
+//TLB GENERATION OF THE PROCESS WHEN THE ENTRY WAS FILLED, GEN BIT = 12
+//AN ENTRY ONLY HITS WHILE IT MATCHES THE PROCESS' CURRENT GENERATION
+#define GEN_HIBIT 44
+#define GEN_LOBIT 33
+
+//PID BIT = 20
+#define PID_HIBIT 32
 #define PID_LOBIT 13
 
 //FRMNUM BIT = 12
@@ -44,9 +71,11 @@ int init_tlbmemphy(struct memphy_struct *mp, int max_size);
 	(((~0ULL) << (l)) & (~0ULL >> (TLB_BITS_PER_LONG  - (h) - 1)))
 
 #define TLB_ENTRY_FREE_MASK TLB_GENMASK(FREE_HIBIT, FREE_LOBIT)
+#define TLB_ENTRY_REF_MASK BIT_ULL(REF_BIT)
 #define TLB_ENTRY_VALID_MASK BIT_ULL(VALID_BIT) 
 // #define TLB_ENTRY_DIRTY_MASK BIT(DIRTY_BIT)
 #define TLB_ENTRY_TAG_MASK TLB_GENMASK(TAG_HIBIT, TAG_LOBIT)
+#define TLB_ENTRY_GEN_MASK TLB_GENMASK(GEN_HIBIT, GEN_LOBIT)
 #define TLB_ENTRY_PID_MASK TLB_GENMASK(PID_HIBIT, PID_LOBIT)
 #define TLB_ENTRY_FRMNUM_MASK TLB_GENMASK(FRMNUM_HIBIT, FRMNUM_LOBIT)
 
@@ -56,18 +85,28 @@ int init_tlbmemphy(struct memphy_struct *mp, int max_size);
 
 //TLB Entry bits extract
 #define TLB_FREE(x) TLB_GETVAL(x, TLB_ENTRY_FREE_MASK, FREE_LOBIT)
+#define TLB_REF(x) TLB_GETVAL(x, TLB_ENTRY_REF_MASK, REF_BIT)
 #define TLB_VALID(x) TLB_GETVAL(x, TLB_ENTRY_VALID_MASK, VALID_BIT)
 // #define TLB_DIRTY(x) TLB_GETVAL(x, TLB_ENTRY_DIRTY_MASK, DIRTY_BIT)
 #define TLB_TAG(x) TLB_GETVAL(x, TLB_ENTRY_TAG_MASK, TAG_LOBIT)
+#define TLB_GEN(x) TLB_GETVAL(x, TLB_ENTRY_GEN_MASK, GEN_LOBIT)
 #define TLB_PID(x) TLB_GETVAL(x, TLB_ENTRY_PID_MASK, PID_LOBIT)
 #define TLB_FRMNUM(x) TLB_GETVAL(x, TLB_ENTRY_FRMNUM_MASK, FRMNUM_LOBIT)
 
 //TLB Entry bits set
 #define SET_TLB_FREE(x, value) TLB_SETVAL(x, value, TLB_ENTRY_FREE_MASK, FREE_LOBIT)
+#define SET_TLB_REF(x, value) TLB_SETVAL(x, value, TLB_ENTRY_REF_MASK, REF_BIT)
 #define SET_TLB_VALID(x, value) TLB_SETVAL(x, value, TLB_ENTRY_VALID_MASK, VALID_BIT)
 // #define SET_TLB_DIRTY(x, value) TLB_SETVAL(x, value, TLB_ENTRY_DIRTY_MASK, DIRTY_BIT)
 #define SET_TLB_TAG(x, value) TLB_SETVAL(x, value, TLB_ENTRY_TAG_MASK, TAG_LOBIT)
+#define SET_TLB_GEN(x, value) TLB_SETVAL(x, value, TLB_ENTRY_GEN_MASK, GEN_LOBIT)
 #define SET_TLB_PID(x, value) TLB_SETVAL(x, value, TLB_ENTRY_PID_MASK, PID_LOBIT)
+
+//LARGEST PID AN ENTRY CAN HOLD, THE LOADER HANDS OUT NO LARGER ONE
+#define TLB_MAX_PID (BIT(PID_HIBIT - PID_LOBIT + 1) - 1)
+
+//A PROCESS GENERATION AS STORED IN AN ENTRY, IT WRAPS TO 0 EVERY 4096 FLUSHES
+#define TLB_GEN_OF(gen) ((gen) & (BIT(GEN_HIBIT - GEN_LOBIT + 1) - 1))
 #define SET_TLB_FRMNUM(x, value) TLB_SETVAL(x, value, TLB_ENTRY_FRMNUM_MASK, FRMNUM_LOBIT)
 
 
@@ -1,4 +1,5 @@
 #ifndef MM_H
+#define MM_H
 
 #include "bitops.h"
 #include "common.h"
@@ -14,13 +15,33 @@
 #define PAGING_MAX_PGN  (DIV_ROUND_UP(BIT(PAGING_CPU_BUS_WIDTH),PAGING_PAGESZ))
 
 #define PAGING_SBRK_INIT_SZ PAGING_PAGESZ
+
+/* Page table walk, see pte_walk() */
+#define PAGING_PGD_IDX(pgn)  ((pgn) >> PAGING_PTBL_BITS)
+#define PAGING_PTBL_IDX(pgn) ((pgn) & (PAGING_PTBL_SZ - 1))
+#if PAGING_MAX_PGN > PAGING_PTBL_SZ * PAGING_PTBL_SZ
+#error "page numbers do not fit the two page table levels"
+#endif
 /* PTE BIT */
 #define PAGING_PTE_PRESENT_MASK BIT(31) 
 #define PAGING_PTE_SWAPPED_MASK BIT(30)
-#define PAGING_PTE_RESERVE_MASK BIT(29)
+#define PAGING_PTE_RESERVE_MASK BIT(29) /* allocated, no frame until first touch */
 #define PAGING_PTE_DIRTY_MASK BIT(28)
 #define PAGING_PTE_EMPTY01_MASK BIT(14)
 #define PAGING_PTE_EMPTY02_MASK BIT(13)
+/* Set on every access of a resident page, cleared by the CLOCK hand.
+ * Only CLOCK reads it, without it the PTEs keep their usual layout */
+#ifdef MM_PAGING_CLOCK
+#define PAGING_PTE_ACCESSED_MASK PAGING_PTE_EMPTY01_MASK
+#else
+#define PAGING_PTE_ACCESSED_MASK 0
+#endif
+
+/* Clean copy of a resident page kept on swap, see pt_leaf_struct swpcopy.
+ * Same SWPTYP/SWPOFF layout as a swapped PTE */
+#define PAGING_SWPCOPY_VALID_MASK BIT(31)
+#define PAGING_SWPCOPY(typ, off) \
+  (PAGING_SWPCOPY_VALID_MASK | ((off) << PAGING_PTE_SWPOFF_LOBIT) | (typ))
 
 /* PTE BIT PRESENT */
 #define PAGING_PTE_SET_PRESENT(pte) (pte=pte|PAGING_PTE_PRESENT_MASK)
@@ -65,6 +86,10 @@
 /* Value operators */
 #define SETBIT(v,mask) (v=v|mask)
 #define CLRBIT(v,mask) (v=v&~mask)
+/* Accessed/dirty bits of a mapped PTE, which TLB hits on other CPUs
+ * may set without the mm lock */
+#define PTE_SETBIT(v,mask) __atomic_fetch_or(&(v), mask, __ATOMIC_RELAXED)
+#define PTE_CLRBIT(v,mask) __atomic_fetch_and(&(v), ~(mask), __ATOMIC_RELAXED)
 
 #define SETVAL(v,value,mask,offst) (v=(v&~mask)|((value<<offst)&mask))
 #define GETVAL(v,mask,offst) ((v&mask)>>offst)
@@ -91,18 +116,77 @@
 #define INCLUDE(x1,x2,y1,y2) (((y1-x1)*(x2-y2)>=0)?1:0)
 #define OVERLAP(x1,x2,y1,y2) (((y2-x1)*(x2-y1)>=0)?1:0)
 
+/*
+ * Paging locks, in the order they are taken:
+ *   mm->lock of the process doing the work (alloc, free, fault, exit,
+ *   dispatch), then mm->lock of the owner of a victim page, only ever
+ *   with a trylock, then the lock of a memphy device.
+ * Victims whose owner cannot be locked right away are skipped, so two
+ * processes evicting each other's pages never wait on one another. A
+ * memphy lock is a leaf, except the RAM lock held over the victim scan
+ * which only trylocks owners.
+ */
+static inline void mm_lock(struct mm_struct *mm)
+{
+#ifdef SYNCH
+  pthread_mutex_lock(&mm->lock);
+#endif
+}
+
+static inline int mm_trylock(struct mm_struct *mm)
+{
+#ifdef SYNCH
+  return pthread_mutex_trylock(&mm->lock);
+#else
+  return 0;
+#endif
+}
+
+static inline void mm_unlock(struct mm_struct *mm)
+{
+#ifdef SYNCH
+  pthread_mutex_unlock(&mm->lock);
+#endif
+}
+
+static inline void MEMPHY_lock(struct memphy_struct *mp)
+{
+#ifdef SYNCH
+  pthread_mutex_lock(&mp->lock);
+#endif
+}
+
+static inline void MEMPHY_unlock(struct memphy_struct *mp)
+{
+#ifdef SYNCH
+  pthread_mutex_unlock(&mp->lock);
+#endif
+}
+
 /* VM region prototypes */
 struct vm_rg_struct * init_vm_rg(int rg_start, int rg_endi);
 int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct* rgnode);
-int enlist_pgn_node(struct pgn_t **pgnlist, int pgn);
-int clear_pgn_node(struct pcb_t * proc , int pgn);
+int enlist_pgn_node(struct mm_struct *mm, int pgn);
+void delist_pgn_node(struct mm_struct *mm, int pgn);
 int vmap_page_range(struct pcb_t *caller, int addr, int pgnum, 
                     struct framephy_struct *frames, struct vm_rg_struct *ret_rg);
 int vm_map_ram(struct pcb_t *caller, int astart, int send, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg);
 int alloc_pages_range(struct pcb_t *caller, int incpgnum, struct framephy_struct **frm_lst);
+int __swap_out_page(struct pcb_t *caller, struct pcb_t *owner, int vicpgn, int *vicfpn);
+int mm_evict_page(struct pcb_t *caller, int *vicfpn);
+void mm_rmap(struct memphy_struct *mram, int fpn, struct mm_struct *mm, int pgn);
+int mm_reclaim(struct pcb_t *kswapd, int low, int high);
+int __swap_in_page(struct pcb_t *caller, int pgn, int fpn);
+int __zero_fill_page(struct pcb_t *caller, int pgn, int fpn);
+int mm_swap_stat(void);
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                 struct memphy_struct *mpdst, int dstfpn) ;
 int pte_set_fpn(uint32_t *pte, int fpn);
+uint32_t *pte_walk(struct mm_struct *mm, int pgn, int alloc);
+uint32_t pte_get(struct mm_struct *mm, int pgn);
+uint32_t *pte_swpcopy(struct mm_struct *mm, int pgn);
+int *pgn_next(struct mm_struct *mm, int pgn);
+int *pgn_prev(struct mm_struct *mm, int pgn);
 int pte_set_swap(uint32_t *pte, int swptyp, int swpoff);
 int init_pte(uint32_t *pte,
              int pre,    // present
@@ -122,10 +206,18 @@ typedef uint64_t TLB_entry_t;
 /* CPUTLB prototypes */
 int tlb_change_all_page_tables_of(struct pcb_t *proc,  struct memphy_struct * mp);
 int tlb_flush_tlb_of(struct pcb_t *proc, struct memphy_struct * mp);
+int tlb_init_cpus(struct memphy_struct *tlbs, int num_cpus);
+int tlb_free_cpus(void);
+int tlb_dispatch(struct pcb_t *proc, int cpu);
+int tlb_preempt(struct pcb_t *proc);
+int tlb_shootdown(struct memphy_struct *tlb, struct pcb_t *proc, int pgnum);
+int tlb_shootdown_apply(struct memphy_struct *tlb);
 int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
 int tlbfree_data(struct pcb_t *proc, uint32_t reg_index);
 int tlbread(struct pcb_t * proc, uint32_t source, uint32_t offset, uint32_t destination) ;
 int tlbwrite(struct pcb_t * proc, BYTE data, uint32_t destination, uint32_t offset);
+int tlbexit(struct pcb_t *proc);
+int tlbreclaim(struct pcb_t *kswapd, int low, int high);
 int init_tlbmemphy(struct memphy_struct *mp, int max_size);
 int TLBMEMPHY_read(struct memphy_struct * mp, int addr, TLB_entry_t *value);
 int TLBMEMPHY_write(struct memphy_struct * mp, int addr, TLB_entry_t data);
@@ -144,28 +236,49 @@ int pgwrite(
 		BYTE data, // Data to be wrttien into memory
 		uint32_t destination, // Index of destination register
 		uint32_t offset);
+int pgexit(struct pcb_t *proc);
+int free_pcb_memph(struct pcb_t *caller);
 /* Local VM prototypes */
 struct vm_rg_struct * get_symrg_byid(struct mm_struct* mm, int rgid);
 int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend);
 int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg);
 int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz);
+int dec_vma_limit(struct pcb_t *caller, int vmaid);
 int find_victim_page(struct mm_struct* mm, int *pgn);
+int find_victim_frame(struct pcb_t *caller, int *fpn);
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid);
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr);
+struct vm_area_struct *create_vm_area(struct mm_struct *mm, int vmaid,
+                                      unsigned long vmastart, unsigned long vmaend);
 
 /* MEM/PHY protypes */
 int MEMPHY_get_freefp(struct memphy_struct *mp, int *fpn);
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn);
+int MEMPHY_get_freefps(struct memphy_struct *mp, int n, int *fpns);
+int MEMPHY_put_freefps(struct memphy_struct *mp, int n, const int *fpns);
+int MEMPHY_init_rmap(struct memphy_struct *mp);
+int MEMPHY_nr_freefp(struct memphy_struct *mp);
+int MEMPHY_read_frame(struct memphy_struct *mp, int fpn, BYTE *buf);
+int MEMPHY_write_frame(struct memphy_struct *mp, int fpn, const BYTE *buf);
+int MEMPHY_read_frames(struct memphy_struct *mp, int n, const int *fpns, BYTE *buf);
+int MEMPHY_write_frames(struct memphy_struct *mp, int n, const int *fpns, const BYTE *buf);
+int MEMPHY_cp_frame(struct memphy_struct *src, int srcfpn,
+                    struct memphy_struct *dst, int dstfpn);
 int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value);
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data);
 int MEMPHY_dump(struct memphy_struct * mp);
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg);
+int free_memphy(struct memphy_struct *mp);
+int MEMPHY_set_seek_latency(struct memphy_struct *mp, int lat);
+int MEMPHY_seek_stat(struct memphy_struct *mp, const char *name);
+int MEMPHY_frame_stat(struct memphy_struct *mp, const char *name);
 /* DEBUG */
 int print_list_fp(struct framephy_struct *fp);
 int print_list_rg(struct vm_rg_struct *rg);
-int print_list_vma(struct vm_area_struct *rg);
+int print_list_vma(struct mm_struct *mm);
 
 
-int print_list_pgn(struct pgn_t *ip);
+int print_list_pgn(struct mm_struct *mm);
 int print_pgtbl(struct pcb_t *ip, uint32_t start, uint32_t end);
 
 int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller);
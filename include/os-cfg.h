@@ -6,15 +6,44 @@
 
 #define CPU_TLB 
 #define CPUTLB_FIXED_TLBSZ
+/* TLB ways per set, 0 makes the TLB fully-associative */
+#define CPUTLB_NWAYS 8
+/* Entries of the per-CPU L1 TLB in front of the configured TLB, it uses
+ * the same replacement policy. Comment out for a single-level TLB */
+#define CPUTLB_L1_SZ 32
+/* Keep an entry in only one TLB level instead of L1 inside L2 */
+// #define CPUTLB_L1_EXCLUSIVE
 #define MM_PAGING
 // #define MM_FIXED_MEMSZ
+/* Replace pages with CLOCK (second chance) instead of FIFO */
+// #define MM_PAGING_CLOCK
+/* Pick victims among the pages of every process, not only the caller's */
+// #define MM_PAGING_GLOBAL
+/* Background reclaim: when free RAM frames drop below the low watermark
+ * kswapd evicts pages until the high one is reached. Watermarks are in
+ * percent of RAM, at least one frame. Needs MM_PAGING_GLOBAL */
+// #define MM_KSWAPD
+#define MM_KSWAPD_LOW 10
+#define MM_KSWAPD_HIGH 25
+/* ALLOC only reserves pages, each gets a zeroed frame on first touch */
+// #define MM_DEMAND_PAGING
+/* Make the swap devices sequential (tape-like) instead of random access */
+// #define MM_SEQ_SWAP
+/* Modelled time a sequential device head needs to travel one byte */
+#define MEMPHY_SEEK_LATENCY 1
 // #define VMDBG 1
 #define MMDBG 1
 #define IODUMP 1
 #define PAGETBL_DUMP 1
 
 #define TLB_DUMP
+/* Print statistics when the simulation ends, and the generation of each
+ * entry in TLB dumps. Off by default to keep the usual output */
+// #define STAT_DUMP
 
 #define SYNCH
 
+/* Skip time slots in which no device has work to do */
+// #define IDLE_FASTFWD
+
 #endif
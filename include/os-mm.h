@@ -1,19 +1,33 @@
 #ifndef OSMM_H
 #define OSMM_H
 
+#include <sys/types.h> /* pthread_mutex_t */
+
 // #define MM_PAGING
 #define PAGING_MAX_MMSWP 4 /* max number of supported swapped space */
 #define PAGING_MAX_SYMTBL_SZ 30
 
+/* Page tables are a two level radix tree over the 14-bit page number:
+ * the high 7 bits index the directory, the low 7 bits a leaf. Leaves
+ * are allocated when the first page they cover is mapped */
+#define PAGING_PTBL_BITS 7
+#define PAGING_PTBL_SZ (1 << PAGING_PTBL_BITS)
+
+/* Free regions of a vm area are kept on a skip list in address order,
+ * so a freed range finds its neighbours to merge with, and in bins by
+ * size class: bin k holds regions of 2^k up to 2^(k+1)-1 pages */
+#define PAGING_FREERG_LEVELS 8
+#define PAGING_FREERG_BINS (2 * PAGING_PTBL_BITS + 1)
+
+/* Areas of an address space, e.g. data, heap, stack and mapped ones */
+#define PAGING_MAX_VMA 8
+
+struct pcb_t;
+
 typedef char BYTE;
 typedef uint32_t addr_t;
 //typedef unsigned int uint32_t;
 
-struct pgn_t{
-   int pgn;
-   struct pgn_t *pg_next; 
-};
-
 /*
  *  Memory region struct
  */
@@ -24,6 +38,22 @@ struct vm_rg_struct {
    struct vm_rg_struct *rg_next;
 };
 
+/*
+ *  Free region of a vm area
+ */
+struct vm_freerg_struct {
+   unsigned long rg_start;
+   unsigned long rg_end;
+
+   /* Skip list links, next[0] is the following free region */
+   int level;
+   struct vm_freerg_struct *next[PAGING_FREERG_LEVELS];
+
+   /* Regions of the same size class */
+   struct vm_freerg_struct *bin_next;
+   struct vm_freerg_struct *bin_prev;
+};
+
 /*
  *  Memory area struct
  */
@@ -38,23 +68,79 @@ struct vm_area_struct {
  * unsigned long vm_limit = vm_end - vm_start
  */
    struct mm_struct *vm_mm;
-   struct vm_rg_struct *vm_freerg_list;
-   struct vm_area_struct *vm_next;
+
+   /* Free regions below sbrk, never two adjacent ones. vm_freerg_list
+    * heads the skip list, binmap has a bit set per non empty bin */
+   struct vm_freerg_struct vm_freerg_list;
+   struct vm_freerg_struct *vm_freerg_bin[PAGING_FREERG_BINS];
+   uint32_t vm_freerg_binmap;
+   uint32_t vm_freerg_seed;
+};
+
+/*
+ * Page table leaf, covers PAGING_PTBL_SZ consecutive pages
+ */
+struct pt_leaf_struct {
+   uint32_t pte[PAGING_PTBL_SZ];
+
+   /* Swap slot still holding an up to date copy of each resident page,
+    * 0 if none. Evicting a clean page with a copy costs no write */
+   uint32_t swpcopy[PAGING_PTBL_SZ];
+
+   /* Neighbours of each page on the resident page ring, as page
+    * numbers, -1 while the page is not on it */
+   int pg_next[PAGING_PTBL_SZ];
+   int pg_prev[PAGING_PTBL_SZ];
 };
 
 /* 
  * Memory management struct
  */
 struct mm_struct {
-   uint32_t *pgd;
+   /* Page directory, NULL where no page of the leaf was mapped yet,
+    * walk it with pte_walk() */
+   struct pt_leaf_struct *pgd[PAGING_PTBL_SZ];
 
-   struct vm_area_struct *mmap;
+   /* Areas sorted by vm_start, never overlapping, so both their starts
+    * and ends ascend and an address is found by binary search. vmatbl
+    * indexes the same areas by vm_id */
+   struct vm_area_struct *mmap[PAGING_MAX_VMA];
+   int map_count;
+   struct vm_area_struct *vmatbl[PAGING_MAX_VMA];
 
    /* Currently we support a fixed number of symbol */
    struct vm_rg_struct symrgtbl[PAGING_MAX_SYMTBL_SZ];
 
-   /* list of free page */
-   struct pgn_t *fifo_pgn;
+   /* Ring of resident pages in load order, linked through the page
+    * table leaves. fifo_pgn is the replacement hand: the oldest page,
+    * with the newest one right behind it, -1 when the ring is empty */
+   int fifo_pgn;
+
+   /* Process the mm belongs to */
+   struct pcb_t *owner;
+
+#ifdef SYNCH
+   /* Guards everything above, see the lock order in mm.h */
+   pthread_mutex_t lock;
+#endif
+};
+
+/*
+ * TLB hit/miss/eviction counters
+ */
+struct tlb_stat_struct {
+   unsigned long hits;
+   unsigned long misses;
+   unsigned long evictions;
+   unsigned long shootdowns;   /* invalidations received from other CPUs */
+};
+
+/*
+ * TLB shootdown message, pgn -1 drops every page of pid
+ */
+struct tlb_shootdown_struct {
+   int pid;
+   int pgn;
 };
 
 /*
@@ -66,6 +152,7 @@ struct framephy_struct {
 
    /* Resereed for tracking allocated framed */
    struct mm_struct* owner;
+   int pgn;                   /* page of owner held in the frame */
 };
 
 struct memphy_struct {
@@ -76,10 +163,54 @@ struct memphy_struct {
    /* Sequential device fields */ 
    int rdmflg;
    int cursor;
+   int seeklat;               /* modelled time per byte of head travel */
+   unsigned long seeks;
+   unsigned long seekdist;    /* total bytes of head travel */
+   unsigned long seektime;
 
    /* Management structure */
-   struct framephy_struct *free_fp_list;
    struct framephy_struct *used_fp_list;
+
+   /* Free frame bitmap, two levels, see mm-memphy.c */
+   uint64_t *fpbitmap;
+   uint64_t *fpsummary;
+   int fpwords;               /* words in fpbitmap */
+   int fpcount;               /* frames of the device */
+   int fpfree;                /* free frames left */
+   int fpminfree;             /* fewest free frames seen */
+
+   /* Reverse map, the page held in each frame, owner NULL if none */
+   struct framephy_struct *fprmap;
+   int fphand;                /* global replacement hand */
+
+   /* TLB cache fields, set-associative organization */
+   int tlbsets;
+   int tlbways;
+
+   /* Second TLB level behind this one, NULL for a single-level TLB */
+   struct memphy_struct *tlbl2;
+
+   /* TLB replacement state */
+   int tlbpolicy;
+   int *tlbhand;              /* CLOCK hand of each set */
+   unsigned long *tlbstamp;   /* LRU last use of each entry */
+   unsigned long tlbtick;
+
+   /* TLB statistics, global and indexed by pid */
+   struct tlb_stat_struct tlbstat;
+   struct tlb_stat_struct *tlbpidstat;
+   int tlbpidstat_sz;
+
+   /* Shootdowns queued by other CPUs, applied at the next slot boundary */
+   struct tlb_shootdown_struct *tlbsd;
+   int tlbsd_cnt;
+   int tlbsd_overflow;        /* batch was full, flush the whole TLB */
+
+#ifdef SYNCH
+   /* Guards the free frames, the reverse map and the cursor, never
+    * held while taking another lock */
+   pthread_mutex_t lock;
+#endif
 };
 
 #endif
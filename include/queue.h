@@ -4,11 +4,17 @@
 
 #include "common.h"
 
-#define MAX_QUEUE_SIZE 10
+/* Initial capacity of a queue, must be a power of two */
+#define QUEUE_INIT_SIZE 16
 
+/* Growable circular buffer of PCBs. A zero-filled queue_t is a valid
+ * empty queue, its buffer is allocated on the first enqueue() and
+ * doubled whenever it fills up, so capacity is always a power of two */
 struct queue_t {
-	struct pcb_t * proc[MAX_QUEUE_SIZE];
-	int size;
+	struct pcb_t ** proc;
+	int head;	// Index of the oldest process
+	int size;	// Number of queued processes
+	int capacity;
 };
 
 void enqueue(struct queue_t * q, struct pcb_t * proc);
@@ -17,5 +23,8 @@ struct pcb_t * dequeue(struct queue_t * q);
 
 int empty(struct queue_t * q);
 
+/* Release the buffer of [q], leaving it as an empty queue */
+void free_queue(struct queue_t * q);
+
 #endif
 
@@ -11,14 +11,16 @@
 
 int queue_empty(void);
 
-void init_scheduler(void);
+/* Set up one run queue per CPU */
+void init_scheduler(int num_cpus);
 void finish_scheduler(void);
 
-/* Get the next process from ready queue */
-struct pcb_t * get_proc(void);
+/* Get the next process for CPU [cpu], stealing from a peer if its
+ * own run queue is empty */
+struct pcb_t * get_proc(int cpu);
 
-/* Put a process back to run queue */
-void put_proc(struct pcb_t * proc);
+/* Put a process back to the run queue of CPU [cpu] */
+void put_proc(int cpu, struct pcb_t * proc);
 
 /* Add a new process to ready queue */
 void add_proc(struct pcb_t * proc);
@@ -4,13 +4,13 @@
 #include <pthread.h>
 #include <stdint.h>
 
+/* Wake-up slot of a device that has no work until another device
+ * makes some, e.g. an idle CPU */
+#define TIMER_IDLE UINT64_MAX
+
 struct timer_id_t {
-	int done;
-	int fsh;
-	pthread_cond_t event_cond;
-	pthread_mutex_t event_lock;
-	pthread_cond_t timer_cond;
-	pthread_mutex_t timer_lock;
+	int done;	// Waiting at the barrier of the current slot
+	int fsh;	// Detached from the timer
 };
 
 void start_timer();
@@ -23,6 +23,15 @@ void detach_event(struct timer_id_t * event);
 
 void next_slot(struct timer_id_t* timer_id);
 
+/* Like next_slot() but tell the timer that the caller has nothing to do
+ * before slot [wake]. When every device waits like this the timer jumps
+ * straight to the earliest wake-up slot (see IDLE_FASTFWD) */
+void next_slot_until(struct timer_id_t* timer_id, uint64_t wake);
+
+/* Close the current slot on behalf of every attached device, for
+ * single-threaded engines that never block in next_slot() */
+void advance_slot(uint64_t wake);
+
 uint64_t current_time();
 
 #endif
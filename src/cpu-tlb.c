@@ -14,17 +14,179 @@
 #include "mm.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef CPU_TLB
 #include "cpu-tlbcache.h"
 
 
+/* Page tables are guarded by the lock of their mm, frames and swap by
+ * the lock of their device (see mm.h). The TLBs are private, so hits
+ * run without taking any of them */
 #ifdef SYNCH
   #include <pthread.h>
-  ///LOCKS
-  static pthread_mutex_t tlb_lock;
-  ///
 #endif
+
+/* Private TLB of each CPU, indexed by CPU id */
+static struct memphy_struct *cpu_tlbs;
+static int nr_cpu_tlbs;
+#ifdef SYNCH
+static pthread_mutex_t *shootdown_lock; // Guards the shootdown batch of each TLB
+#endif
+
+/*tlb_init_cpus - register the private TLBs of the CPUs
+ *@tlbs: Array of num_cpus initialized TLBs, tlbs[i] belongs to CPU i
+ */
+int tlb_init_cpus(struct memphy_struct *tlbs, int num_cpus)
+{
+  cpu_tlbs = tlbs;
+  nr_cpu_tlbs = num_cpus;
+#ifdef SYNCH
+  shootdown_lock = (pthread_mutex_t *)malloc(num_cpus * sizeof(pthread_mutex_t));
+  for (int cpu = 0; cpu < num_cpus; cpu++)
+    pthread_mutex_init(&shootdown_lock[cpu], NULL);
+#endif
+  return 0;
+}
+
+/*tlb_free_cpus - forget the TLBs registered by tlb_init_cpus
+ *
+ * The TLBs themselves belong to the caller.
+ */
+int tlb_free_cpus(void)
+{
+#ifdef SYNCH
+  for (int cpu = 0; cpu < nr_cpu_tlbs; cpu++)
+    pthread_mutex_destroy(&shootdown_lock[cpu]);
+  free(shootdown_lock);
+  shootdown_lock = NULL;
+#endif
+  cpu_tlbs = NULL;
+  nr_cpu_tlbs = 0;
+  return 0;
+}
+
+/*tlb_dispatch - switch to the TLB of the CPU about to run a process
+ *@proc: Process being dispatched
+ *@cpu: CPU id
+ */
+int tlb_dispatch(struct pcb_t *proc, int cpu)
+{
+  /* Shootdowns for the process may have been queued since the slot
+   * started, by a CPU evicting one of its pages. Taking its mm lock
+   * orders us after that eviction, applying them again makes sure none
+   * of its stale entries is hit from here on */
+  mm_lock(proc->mm);
+  tlb_shootdown_apply(&cpu_tlbs[cpu]);
+  proc->tlb = &cpu_tlbs[cpu];
+  proc->tlb_cpus |= BIT_MASK(cpu);
+  __atomic_store_n(&proc->tlb_active, 1, __ATOMIC_RELAXED);
+  mm_unlock(proc->mm);
+  return 0;
+}
+
+/*tlb_preempt - mark a process as no longer running
+ *@proc: Process being put back to its run queue
+ *
+ * From here on other CPUs may evict its pages.
+ */
+int tlb_preempt(struct pcb_t *proc)
+{
+  __atomic_store_n(&proc->tlb_active, 0, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*tlb_shootdown_queue - ask a CPU to drop (pid, pgnum) from its TLB
+ *
+ * A CPU is the only one touching its TLB entries, others only append
+ * to its batch. A full batch degrades to flushing the whole TLB, which
+ * is cheaper than keeping an unbounded queue.
+ */
+static void tlb_shootdown_queue(int cpu, int pid, int pgnum)
+{
+  struct memphy_struct *tlb = &cpu_tlbs[cpu];
+
+#ifdef SYNCH
+  pthread_mutex_lock(&shootdown_lock[cpu]);
+#endif
+  if (tlb->tlbsd_cnt < TLB_SHOOTDOWN_BATCH)
+  {
+    tlb->tlbsd[tlb->tlbsd_cnt].pid = pid;
+    tlb->tlbsd[tlb->tlbsd_cnt].pgn = pgnum;
+    __atomic_store_n(&tlb->tlbsd_cnt, tlb->tlbsd_cnt + 1, __ATOMIC_RELAXED);
+  }
+  else
+    __atomic_store_n(&tlb->tlbsd_overflow, 1, __ATOMIC_RELAXED);
+#ifdef SYNCH
+  pthread_mutex_unlock(&shootdown_lock[cpu]);
+#endif
+}
+
+/*tlb_shootdown_apply - apply the shootdowns other CPUs sent to a TLB
+ *@tlb: TLB of the calling CPU
+ */
+int tlb_shootdown_apply(struct memphy_struct *tlb)
+{
+  struct tlb_shootdown_struct batch[TLB_SHOOTDOWN_BATCH];
+  int cnt, overflow, i;
+
+  /* Unlocked peek, a message racing with it is seen next slot */
+  if (__atomic_load_n(&tlb->tlbsd_cnt, __ATOMIC_RELAXED) == 0
+      && !__atomic_load_n(&tlb->tlbsd_overflow, __ATOMIC_RELAXED))
+    return 0;
+
+#ifdef SYNCH
+  pthread_mutex_lock(&shootdown_lock[tlb - cpu_tlbs]);
+#endif
+  cnt = tlb->tlbsd_cnt;
+  overflow = tlb->tlbsd_overflow;
+  memcpy(batch, tlb->tlbsd, cnt * sizeof(struct tlb_shootdown_struct));
+  __atomic_store_n(&tlb->tlbsd_cnt, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&tlb->tlbsd_overflow, 0, __ATOMIC_RELAXED);
+#ifdef SYNCH
+  pthread_mutex_unlock(&shootdown_lock[tlb - cpu_tlbs]);
+#endif
+
+  if (overflow)
+  {
+    memset(tlb->storage, 0, tlb->maxsz);
+    if (tlb->tlbl2 != NULL)
+      memset(tlb->tlbl2->storage, 0, tlb->tlbl2->maxsz);
+    tlb->tlbstat.shootdowns++;
+    return 0;
+  }
+
+  for (i = 0; i < cnt; i++)
+    tlb_cache_invalidate(tlb, batch[i].pid, batch[i].pgn);
+  tlb->tlbstat.shootdowns += cnt;
+  return 0;
+}
+
+/*tlb_shootdown - drop a page of a process from every TLB
+ *@local: TLB of the calling CPU, NULL when not called from a CPU
+ *@proc: Process owning the page, the one running on the calling CPU
+ *       or one not running at all
+ *@pgnum: Page number, -1 for every page of the process
+ *
+ * The local TLB is invalidated right away. The other CPUs the process
+ * has run on get a message and apply it at their next slot boundary,
+ * or when they dispatch the process, whichever comes first.
+ */
+int tlb_shootdown(struct memphy_struct *local, struct pcb_t *proc, int pgnum)
+{
+  int cpu;
+
+  if (local != NULL)
+    tlb_cache_invalidate(local, proc->pid, pgnum);
+
+  for (cpu = 0; cpu < nr_cpu_tlbs; cpu++)
+  {
+    struct memphy_struct *tlb = &cpu_tlbs[cpu];
+    if (tlb != local && (proc->tlb_cpus & BIT_MASK(cpu)))
+      tlb_shootdown_queue(cpu, proc->pid, pgnum);
+  }
+  return 0;
+}
 int tlb_change_all_page_tables_of(struct pcb_t *proc,  struct memphy_struct * mp)
 {
   /* TODO update all page table directory info 
@@ -34,10 +196,28 @@ int tlb_change_all_page_tables_of(struct pcb_t *proc,  struct memphy_struct * mp
   return 0;
 }
 
+/*tlb_flush_tlb_of - drop every TLB entry of a process
+ *@proc: Process whose entries are flushed
+ *@mp: TLB to flush, the process' own TLB if NULL
+ *
+ * Entries are tagged with the generation of their process when they are
+ * filled, so bumping proc->tlb_gen is enough: stale entries stop hitting
+ * and are dropped lazily when a lookup meets them. Only when the
+ * generation stored in the entries wraps around do we sweep the TLB, so
+ * that entries from 4096 flushes ago cannot come back to life, on every
+ * CPU the process has run on unless @mp names a single TLB.
+ */
 int tlb_flush_tlb_of(struct pcb_t *proc, struct memphy_struct * mp)
 {
-  /* TODO flush tlb cached*/
-  tlb_cache_invalidate(proc->tlb, proc->pid, -1);
+  /* Only the CPU running the process touches its generation */
+  proc->tlb_gen++;
+  if (TLB_GEN_OF(proc->tlb_gen) == 0)
+  {
+    if (mp == NULL || mp == proc->tlb)
+      tlb_shootdown(proc->tlb, proc, -1);
+    else
+      tlb_cache_invalidate(mp, proc->pid, -1);
+  }
   return 0;
 }
 
@@ -49,9 +229,7 @@ int tlb_flush_tlb_of(struct pcb_t *proc, struct memphy_struct * mp)
 int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 {
 
-#ifdef SYNCH
-  pthread_mutex_lock(&tlb_lock);
-#endif
+  mm_lock(proc->mm);
   #ifdef TLB_DUMP
     printf("----- TLB ALLOC ----- PID: %d PC: %d-----\n", proc->pid, proc->pc);
   #endif
@@ -66,9 +244,7 @@ int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 
   /* By default using vmaid = 0 */
   if (__alloc(proc, 0, reg_index, size, &addr) != 0){
-  #ifdef SYNCH
-    pthread_mutex_unlock(&tlb_lock);
-  #endif
+    mm_unlock(proc->mm);
     return -1;
   }
 
@@ -77,9 +253,7 @@ int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
   struct vm_area_struct *cur_vma = get_vma_by_num(proc->mm, 0);
   if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
   {
-    #ifdef SYNCH
-      pthread_mutex_unlock(&tlb_lock);
-    #endif
+    mm_unlock(proc->mm);
     return -1;
   }
 
@@ -95,12 +269,15 @@ int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
   #endif
   /* TODO update TLB CACHED frame num of the new allocated page(s)*/
   /* by using tlb_cache_read()/tlb_cache_write()*/
+#ifdef MM_DEMAND_PAGING
+  /* Pages get their frame on first touch, caching them now would
+   * back every one of them */
+  pgn_count = 0;
+#endif
   for (; pgit < pgn_count; ++pgit){
 
     if (pg_getpage(proc->mm, pgn + pgit, &frmnum, proc) != 0){
-      #ifdef SYNCH
-        pthread_mutex_unlock(&tlb_lock);
-      #endif
+        mm_unlock(proc->mm);
       return -1;
     }
 
@@ -108,9 +285,7 @@ int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
       #ifdef TLB_DUMP
         printf("TLB page fault!:\n");
       #endif
-      #ifdef SYNCH
-        pthread_mutex_unlock(&tlb_lock);
-      #endif
+        mm_unlock(proc->mm);
       return -1;
     }
 
@@ -118,10 +293,8 @@ int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
       printf("TLB-Alloc: Caching PID: %d PAGE: %d FRAME: %d\n", proc->pid, pgn + pgit, frmnum);
     #endif
 
-    if (tlb_cache_write(proc->tlb, proc->pid, pgn + pgit, frmnum) != 0){
-      #ifdef SYNCH
-        pthread_mutex_unlock(&tlb_lock);
-      #endif
+    if (tlb_cache_write(proc->tlb, proc->pid, proc->tlb_gen, pgn + pgit, frmnum) != 0){
+        mm_unlock(proc->mm);
       return -1;
     }
   }
@@ -137,9 +310,7 @@ int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
     MEMPHY_dump(proc->mram);
   #endif
 
-#ifdef SYNCH
-  pthread_mutex_unlock(&tlb_lock);
-#endif
+  mm_unlock(proc->mm);
   return 0;
 }
 
@@ -150,16 +321,17 @@ int tlballoc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
  */
 int tlbfree_data(struct pcb_t *proc, uint32_t reg_index)
 {
-  #ifdef SYNCH
-    pthread_mutex_lock(&tlb_lock);
-  #endif
+    mm_lock(proc->mm);
   #ifdef TLB_DUMP
     printf("----- TLB FREE ----- PID: %d PC: %d-----\n", proc->pid, proc->pc);
   #endif
   struct vm_rg_struct *currg = get_symrg_byid(proc->mm, reg_index);
   struct vm_area_struct *cur_vma = get_vma_by_num(proc->mm, 0);
   if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
+  {
+    mm_unlock(proc->mm);
 	  return -1;
+  }
 
   #ifdef TLB_DUMP
     printf("reg_index: %d\n", reg_index);
@@ -180,14 +352,14 @@ int tlbfree_data(struct pcb_t *proc, uint32_t reg_index)
   int pgn_count = PAGING_PAGE_ALIGNSZ(size) / PAGING_PAGESZ;
 
   for (; pgit < pgn_count; ++pgit){
-    tlb_cache_invalidate(proc->tlb, proc->pid, pgn + pgit);
+    tlb_shootdown(proc->tlb, proc, pgn + pgit);
 
     #ifdef TLB_DUMP
       printf("TLB-Free: Freeing PID: %d PAGE: %d\n", proc->pid, pgn + pgit);
     #endif
   }
 
-  pgfree_data(proc, reg_index);
+  __free(proc, 0, reg_index);
 
   #ifdef TLB_DUMP
   printf("After free TLB dump:\n");
@@ -200,14 +372,29 @@ int tlbfree_data(struct pcb_t *proc, uint32_t reg_index)
     MEMPHY_dump(proc->mram);
   #endif
 
-#ifdef SYNCH
-  pthread_mutex_unlock(&tlb_lock);
-#endif
+  mm_unlock(proc->mm);
 
   return 0;
 }
 
 
+/*tlb_mark_pte - set the accessed/dirty bits of a page on a TLB hit
+ *@proc: Process executing the instruction
+ *@pgn: page number
+ *@bits: PTE bits to set
+ *
+ * Hits do not take the mm lock, so the bits are set atomically. The
+ * PTE still maps the cached frame: victim scans pass over the pages of
+ * a process while its tlb_active is set, see find_victim_frame().
+ */
+static void tlb_mark_pte(struct pcb_t *proc, int pgn, uint32_t bits)
+{
+  uint32_t *pte = pte_walk(proc->mm, pgn, 0);
+
+  if (pte != NULL)
+    PTE_SETBIT(*pte, bits);
+}
+
 /*tlbread - CPU TLB-based read a region memory
  *@proc: Process executing the instruction
  *@source: index of source register
@@ -230,7 +417,9 @@ int tlbread(struct pcb_t * proc, uint32_t source,
   struct vm_rg_struct *currg = get_symrg_byid(proc->mm, source);
   struct vm_area_struct *cur_vma = get_vma_by_num(proc->mm, 0);
   if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
+  {
 	  return -1;
+  }
 
   //CPU address calculate
   int addr = currg->rg_start + offset;
@@ -240,9 +429,6 @@ int tlbread(struct pcb_t * proc, uint32_t source,
       printf("read region=%d offset=%d\n", source, offset); 
       printf("Address out of range!\n");
     #endif
-#ifdef SYNCH
-  pthread_mutex_unlock(&tlb_lock);
-#endif
     return -1;
   }
 
@@ -250,10 +436,7 @@ int tlbread(struct pcb_t * proc, uint32_t source,
   int off = PAGING_OFFST(addr);
 
   //get frmnum
-  if (tlb_cache_read(proc->tlb, proc->pid, pgn, &frmnum) != 0){
-#ifdef SYNCH
-  pthread_mutex_unlock(&tlb_lock);
-#endif
+  if (tlb_cache_read(proc->tlb, proc->pid, proc->tlb_gen, pgn, &frmnum) != 0){
     return -1;
   }
   ///
@@ -279,24 +462,26 @@ int tlbread(struct pcb_t * proc, uint32_t source,
 
   if (frmnum < 0)
   {
-    //TLB MISS, GET DATA THROUGH PAGE TABLE
-    if (pg_getpage(proc->mm, pgn, &frmnum, proc) != 0 || frmnum < 0){
+    //TLB MISS, GET DATA THROUGH PAGE TABLE, it marks the page accessed
+    mm_lock(proc->mm);
+    int err = pg_getpage(proc->mm, pgn, &frmnum, proc);
+    mm_unlock(proc->mm);
+    if (err != 0 || frmnum < 0){
       #ifdef IODUMP
         printf("Page fault!!!\n");
       #endif
-      #ifdef SYNCH
-        pthread_mutex_unlock(&tlb_lock);
-      #endif
       return -1;
     }
     /* TODO update TLB CACHED with frame num of recent accessing page(s)*/
     /* by using tlb_cache_read()/tlb_cache_write()*/
-    tlb_cache_write(proc->tlb, proc->pid, pgn, frmnum);
+    tlb_cache_write(proc->tlb, proc->pid, proc->tlb_gen, pgn, frmnum);
 
     #ifdef TLB_DUMP
       printf("TLB-Read: Caching PID: %d PAGE: %d FRAME: %d DATA: %d\n", proc->pid, pgn, frmnum, data);
     #endif
   }
+  else
+    tlb_mark_pte(proc, pgn, PAGING_PTE_ACCESSED_MASK);
 
   //Read from memphy
   int phyaddr = (frmnum  << PAGING_ADDR_FPN_LOBIT) + off;
@@ -326,9 +511,6 @@ int tlbread(struct pcb_t * proc, uint32_t source,
 int tlbwrite(struct pcb_t * proc, BYTE data,
              uint32_t destination, uint32_t offset)
 {
-  #ifdef SYNCH
-    pthread_mutex_lock(&tlb_lock);
-  #endif
   #ifdef TLB_DUMP
     printf("----- TLB WRITE ----- PID: %d PC: %d-----\n", proc->pid, proc->pc);
   #endif
@@ -343,7 +525,9 @@ int tlbwrite(struct pcb_t * proc, BYTE data,
   struct vm_rg_struct *currg = get_symrg_byid(proc->mm, destination);
   struct vm_area_struct *cur_vma = get_vma_by_num(proc->mm, 0);
   if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
+  {
 	  return -1;
+  }
 
   //CPU address calculate
   int addr = currg->rg_start + offset;
@@ -353,9 +537,6 @@ int tlbwrite(struct pcb_t * proc, BYTE data,
       printf("write region=%d offset=%d\n", destination, offset); 
       printf("Address out of range!\n");
     #endif
-    #ifdef SYNCH
-      pthread_mutex_unlock(&tlb_lock);
-    #endif  
     return -1;
   }
 
@@ -363,10 +544,7 @@ int tlbwrite(struct pcb_t * proc, BYTE data,
   int off = PAGING_OFFST(addr);
 
   //get frmnum
-  if (tlb_cache_read(proc->tlb, proc->pid, pgn, &frmnum) != 0){
-    #ifdef SYNCH
-      pthread_mutex_unlock(&tlb_lock);
-    #endif
+  if (tlb_cache_read(proc->tlb, proc->pid, proc->tlb_gen, pgn, &frmnum) != 0){
     return -1;
   }
   ///
@@ -392,14 +570,17 @@ int tlbwrite(struct pcb_t * proc, BYTE data,
 
   if (frmnum < 0)
   {
-    //TLB MISS, GET DATA THROUGH PAGE TABLE
-    if (pg_getpage(proc->mm, pgn, &frmnum, proc) != 0){
+    //TLB MISS, GET DATA THROUGH PAGE TABLE, it marks the page accessed
+    mm_lock(proc->mm);
+    int err = pg_getpage(proc->mm, pgn, &frmnum, proc);
+    //The page no longer matches its copy on swap, if any
+    if (err == 0 && frmnum >= 0)
+      PTE_SETBIT(*pte_walk(proc->mm, pgn, 0), PAGING_PTE_DIRTY_MASK);
+    mm_unlock(proc->mm);
+    if (err != 0){
       #ifdef TLB_DUMP
         printf("TLB page fault!:\n");
       #endif
-      #ifdef SYNCH
-        pthread_mutex_unlock(&tlb_lock);
-      #endif  
       return -1;
     }
 
@@ -407,19 +588,18 @@ int tlbwrite(struct pcb_t * proc, BYTE data,
       #ifdef TLB_DUMP
         printf("TLB page fault!:\n");
       #endif
-      #ifdef SYNCH
-        pthread_mutex_unlock(&tlb_lock);
-      #endif
       return -1;
     }
 
     /* TODO update TLB CACHED with frame num of recent accessing page(s)*/
     /* by using tlb_cache_read()/tlb_cache_write()*/
-    tlb_cache_write(proc->tlb, proc->pid, pgn, frmnum);
+    tlb_cache_write(proc->tlb, proc->pid, proc->tlb_gen, pgn, frmnum);
     #ifdef TLB_DUMP
       printf("TLB-Write: Caching PID: %d PAGE: %d FRAME: %d DATA: %d\n", proc->pid, pgn, frmnum, data);
     #endif
   }
+  else
+    tlb_mark_pte(proc, pgn, PAGING_PTE_DIRTY_MASK | PAGING_PTE_ACCESSED_MASK);
 
   //Write from memphy
   int phyaddr = (frmnum  << PAGING_ADDR_FPN_LOBIT) + off;
@@ -430,10 +610,25 @@ int tlbwrite(struct pcb_t * proc, BYTE data,
     MEMPHY_dump(proc->mram);
   #endif
 
-  #ifdef SYNCH
-    pthread_mutex_unlock(&tlb_lock);
-  #endif
   return 0;
 }
 
+/*tlbexit - CPU TLB-based release of a finished process
+ *@proc: Process that finished
+ */
+int tlbexit(struct pcb_t *proc)
+{
+  tlb_flush_tlb_of(proc, NULL);
+  pgexit(proc);
+  return 0;
+}
+
+/*tlbreclaim - background page reclaim, see mm_reclaim
+ *@kswapd: Reclaimer context, its tlb is NULL so shootdowns only queue
+ */
+int tlbreclaim(struct pcb_t *kswapd, int low, int high)
+{
+  return mm_reclaim(kswapd, low, high);
+}
+
 #endif
@@ -20,6 +20,11 @@
 #include "cpu-tlbcache.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TLB_X86_SIMD
+#endif
 
 #define init_tlbcache(mp,sz,...) init_memphy(mp, sz, (1, ##__VA_ARGS__))
 
@@ -27,128 +32,331 @@
 
 
 void print_entry(TLB_entry_t entry){
+#ifdef STAT_DUMP
+      printf("%01lld %05lld %04lld %05lld %05lld",
+      TLB_VALID(entry),
+      TLB_PID(entry),
+      TLB_GEN(entry),
+      TLB_TAG(entry),
+      TLB_FRMNUM(entry)
+   );
+#else
       printf("%01lld %05lld %05lld %05lld",
       TLB_VALID(entry),
       TLB_PID(entry),
       TLB_TAG(entry),
       TLB_FRMNUM(entry)
    );
+#endif
 }
 
-void set_TLB_entry(TLB_entry_t *entry, int valid, int pgnum, int pid, int frmnum){
+void set_TLB_entry(TLB_entry_t *entry, int valid, int pgnum, int pid, int gen, int frmnum){
    *entry = 0;
    SET_TLB_VALID(*entry, valid);
    SET_TLB_TAG(*entry, pgnum);
    SET_TLB_PID(*entry, pid);
+   SET_TLB_GEN(*entry, TLB_GEN_OF(gen));
    SET_TLB_FRMNUM(*entry, frmnum);
 }
 
 /*
- *  tlb_cache_read read TLB cache device
- *  @mp: memphy struct
- *  @pid: process id
- *  @pgnum: page number
- *  @value: obtained value
+ *  tlb_set_of - first entry index of the set caching (pid, pgnum)
+ *  Mixing the pid in keeps processes that touch the same page numbers
+ *  from piling up in the same sets.
  */
-int tlb_cache_read(struct memphy_struct * tlb, int pid, int pgnum, int* frmnum)
+static inline int tlb_set_of(struct memphy_struct *tlb, int pid, int pgnum)
 {
-   /* TODO: the identify info is mapped to 
-    *      cache line by employing:
-    *      direct mapped, associated mapping etc.
-    */
-   //Cast storage to uint64, as each entry is 64 bits
-   int storageSz = tlb->maxsz / sizeof(TLB_entry_t);
+   uint32_t h = (uint32_t)pgnum ^ ((uint32_t)pid * 0x9E3779B1u);
 
-   //SIMULATE FULLY-ASSOC PARALLEL COMPARATORS BY LOOPING
-   for (int index = 0; index < storageSz; index++){
-      TLB_entry_t entry = 0;
-      TLBMEMPHY_read(tlb, index, &entry);
+   h ^= h >> 16;
+   return (int)(h % (uint32_t)tlb->tlbsets) * tlb->tlbways;
+}
 
-      if (TLB_VALID(entry) 
-      && TLB_TAG(entry) == pgnum 
-      && TLB_PID(entry) == pid){
-         *frmnum = TLB_FRMNUM(entry);
-         return 0;
-      }
+/*
+ *  Way lookup kernels
+ *  An entry matches when (entry & mask) == key, with key and mask
+ *  built once per lookup: VALID|PID|TAG finds the entry of a page,
+ *  VALID alone with a zero key finds a free way. The generation and
+ *  the REF bit are left out of the mask and checked by the callers.
+ *  The vector kernels compare 4 (AVX2) or 2 (SSE2) entries per
+ *  instruction, tlb_lookup_init() picks the best one the CPU runs.
+ */
+#define TLB_MATCH_MASK (TLB_ENTRY_VALID_MASK | TLB_ENTRY_PID_MASK | TLB_ENTRY_TAG_MASK)
+
+static inline TLB_entry_t tlb_match_key(int pid, int pgnum)
+{
+   TLB_entry_t key = 0;
+   SET_TLB_VALID(key, 1);
+   SET_TLB_PID(key, pid);
+   SET_TLB_TAG(key, pgnum);
+   return key;
+}
+
+typedef int (*tlb_find_fn)(const TLB_entry_t *ent, int n, TLB_entry_t key, TLB_entry_t mask);
+
+static int tlb_find_scalar(const TLB_entry_t *ent, int n, TLB_entry_t key, TLB_entry_t mask)
+{
+   for (int i = 0; i < n; i++)
+      if ((ent[i] & mask) == key)
+         return i;
+   return -1;
+}
+
+#ifdef TLB_X86_SIMD
+__attribute__((target("sse2")))
+static int tlb_find_sse2(const TLB_entry_t *ent, int n, TLB_entry_t key, TLB_entry_t mask)
+{
+   const __m128i vkey = _mm_set1_epi64x(key);
+   const __m128i vmask = _mm_set1_epi64x(mask);
+   int i = 0;
+
+   for (; i + 4 <= n; i += 4){
+      __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(ent + i)), vmask);
+      __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(ent + i + 2)), vmask);
+      /* No 64-bit compare before SSE4.1: both 32-bit halves must match */
+      __m128i ea = _mm_cmpeq_epi32(a, vkey);
+      __m128i eb = _mm_cmpeq_epi32(b, vkey);
+      ea = _mm_and_si128(ea, _mm_shuffle_epi32(ea, _MM_SHUFFLE(2, 3, 0, 1)));
+      eb = _mm_and_si128(eb, _mm_shuffle_epi32(eb, _MM_SHUFFLE(2, 3, 0, 1)));
+      int bits = _mm_movemask_pd(_mm_castsi128_pd(ea))
+               | (_mm_movemask_pd(_mm_castsi128_pd(eb)) << 2);
+      if (bits)
+         return i + __builtin_ctz(bits);
    }
-   
-   *frmnum = -1;
-   return 0;
+
+   int tail = tlb_find_scalar(ent + i, n - i, key, mask);
+   return (tail < 0) ? -1 : i + tail;
 }
 
+__attribute__((target("avx2")))
+static int tlb_find_avx2(const TLB_entry_t *ent, int n, TLB_entry_t key, TLB_entry_t mask)
+{
+   const __m256i vkey = _mm256_set1_epi64x(key);
+   const __m256i vmask = _mm256_set1_epi64x(mask);
+   int i = 0;
+
+   for (; i + 8 <= n; i += 8){
+      __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(ent + i)), vmask);
+      __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(ent + i + 4)), vmask);
+      int bits = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, vkey)))
+               | (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(b, vkey))) << 4);
+      if (bits)
+         return i + __builtin_ctz(bits);
+   }
+
+   int tail = tlb_find_scalar(ent + i, n - i, key, mask);
+   return (tail < 0) ? -1 : i + tail;
+}
+#endif
+
+static tlb_find_fn tlb_find = tlb_find_scalar;
+static const char *tlb_find_name = "scalar";
+
 /*
- *  tlb_cache_write write TLB cache device
- *  @mp: memphy struct
- *  @pid: process id
- *  @pgnum: page number
- *  @value: obtained value
+ *  tlb_lookup_init - select the lookup kernel once, at TLB creation
  */
-int tlb_cache_write(struct memphy_struct *tlb, int pid, int pgnum, int value)
+static void tlb_lookup_init(void)
 {
-   /* TODO: the identify info is mapped to 
-    *      cache line by employing:
-    *      direct mapped, associated mapping etc.
-    */
-   int storageSz = tlb->maxsz / sizeof(TLB_entry_t);
+#ifdef TLB_X86_SIMD
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")){
+      tlb_find = tlb_find_avx2;
+      tlb_find_name = "avx2";
+   } else if (__builtin_cpu_supports("sse2")){
+      tlb_find = tlb_find_sse2;
+      tlb_find_name = "sse2";
+   }
+#endif
+}
 
-   // pthread_mutex_lock(&tlb_lock);
-   //PRIORITIZE FINDING EXISTING ENTRY TO UPDATE
-   for (int index = 0; index < storageSz; index++){
+/*
+ *  tlb_find_way - index of the first way of the set at [base] matching key
+ */
+static inline int tlb_find_way(struct memphy_struct *tlb, int base, TLB_entry_t key, TLB_entry_t mask)
+{
+   int way = tlb_find((const TLB_entry_t *)tlb->storage + base, tlb->tlbways, key, mask);
+   return (way < 0) ? -1 : base + way;
+}
 
-      TLB_entry_t entry = 0;
-      TLBMEMPHY_read(tlb, index, &entry);
+/*
+ *  tlb_pidstat - counters of [pid], grown on demand
+ */
+static struct tlb_stat_struct *tlb_pidstat(struct memphy_struct *tlb, int pid)
+{
+   if (pid < 0)
+      return NULL;
+
+   if (pid >= tlb->tlbpidstat_sz){
+      int newsz = (tlb->tlbpidstat_sz > 0) ? tlb->tlbpidstat_sz : 16;
+      while (newsz <= pid)
+         newsz *= 2;
+
+      struct tlb_stat_struct *newstat = realloc(tlb->tlbpidstat, newsz * sizeof(struct tlb_stat_struct));
+      if (newstat == NULL)
+         return NULL;
+      for (int i = tlb->tlbpidstat_sz; i < newsz; i++)
+         newstat[i].hits = newstat[i].misses = newstat[i].evictions = 0;
+
+      tlb->tlbpidstat = newstat;
+      tlb->tlbpidstat_sz = newsz;
+   }
 
-      if (TLB_VALID(entry) 
-      && TLB_TAG(entry) == pgnum 
-      && TLB_PID(entry) == pid){
-         //FOUND EXISTING ENTRY
-         set_TLB_entry(&entry, 1, pgnum, pid, value);
-         
-         TLBMEMPHY_write(tlb, index, entry);
+   return &tlb->tlbpidstat[pid];
+}
 
-         return 0;
+/*
+ *  tlb_touch - record a use of entry [index] for the replacement policy
+ */
+static inline void tlb_touch(struct memphy_struct *tlb, int index, TLB_entry_t *entry)
+{
+   switch (tlb->tlbpolicy){
+   case TLB_REPL_LRU:
+      tlb->tlbstamp[index] = ++tlb->tlbtick;
+      break;
+   case TLB_REPL_CLOCK:
+      SET_TLB_REF(*entry, 1);
+      break;
+   }
+}
+
+/*
+ *  tlb_pick_victim - choose the way of a full set to replace
+ *  @base: first entry of the set
+ */
+static int tlb_pick_victim(struct memphy_struct *tlb, int base)
+{
+   int ways = tlb->tlbways;
+   int way, victim;
+
+   switch (tlb->tlbpolicy){
+   case TLB_REPL_LRU:
+      victim = base;
+      for (way = 1; way < ways; way++)
+         if (tlb->tlbstamp[base + way] < tlb->tlbstamp[victim])
+            victim = base + way;
+      return victim;
+
+   case TLB_REPL_CLOCK: {
+      /* Second chance: clear reference bits until the hand
+       * meets an entry that was not used since its last visit */
+      int *hand = &tlb->tlbhand[base / ways];
+      while (1){
+         TLB_entry_t entry = 0;
+         victim = base + *hand;
+         *hand = (*hand + 1) % ways;
+
+         TLBMEMPHY_read(tlb, victim, &entry);
+         if (!TLB_REF(entry))
+            return victim;
+         SET_TLB_REF(entry, 0);
+         TLBMEMPHY_write(tlb, victim, entry);
       }
    }
 
-   //FIND FREE/INVALID SPACE
-   for (int index = 0; index < storageSz; index++){
+   default:
+      return base + rand() % ways;
+   }
+}
+
+/*
+ *  tlb_level_read - look (pid, pgnum) up in a single TLB level
+ *  @take: drop the entry on a hit, it moves to the level above
+ */
+static int tlb_level_read(struct memphy_struct * tlb, int pid, int gen, int pgnum, int* frmnum, int take)
+{
+   /* The identify info is mapped to one set by tlb_set_of(),
+    * only the ways of that set are compared
+    */
+   int base = tlb_set_of(tlb, pid, pgnum);
+
+   //THE PARALLEL COMPARATORS OF A SET, A VECTOR COMPARE WHERE AVAILABLE
+   int index = tlb_find_way(tlb, base, tlb_match_key(pid, pgnum), TLB_MATCH_MASK);
+   if (index >= 0){
       TLB_entry_t entry = 0;
       TLBMEMPHY_read(tlb, index, &entry);
 
-      if (!TLB_VALID(entry)){
-         //FOUND SPACE
-         set_TLB_entry(&entry, 1, pgnum, pid, value);
+      if (TLB_GEN(entry) != TLB_GEN_OF(gen)){
+         //FILLED BEFORE THE LAST FLUSH OF PID, DROP IT NOW
+         SET_TLB_VALID(entry, 0);
+         TLBMEMPHY_write(tlb, index, entry);
+      } else {
+         *frmnum = TLB_FRMNUM(entry);
+
+         if (take)
+            SET_TLB_VALID(entry, 0);
+         else
+            tlb_touch(tlb, index, &entry);
          TLBMEMPHY_write(tlb, index, entry);
 
+         tlb->tlbstat.hits++;
+         struct tlb_stat_struct *pidstat = tlb_pidstat(tlb, pid);
+         if (pidstat != NULL)
+            pidstat->hits++;
          return 0;
       }
    }
+   
+   *frmnum = -1;
 
-   //FREE SPACE NOT FOUND, REPLACE RANDOM EXISTING ENTRY
-   int r = rand() % storageSz;
-   TLB_entry_t victimEntry = 0;
-   TLBMEMPHY_read(tlb, r, &victimEntry);
+   tlb->tlbstat.misses++;
+   struct tlb_stat_struct *pidstat = tlb_pidstat(tlb, pid);
+   if (pidstat != NULL)
+      pidstat->misses++;
+   return 0;
+}
+
+/*
+ *  tlb_level_write - fill (pid, pgnum) into a single TLB level
+ *  @evicted: set to the valid entry the fill replaced, 0 if none
+ */
+static int tlb_level_write(struct memphy_struct *tlb, int pid, int gen, int pgnum, int value, TLB_entry_t *evicted)
+{
+   int base = tlb_set_of(tlb, pid, pgnum);
+
+   *evicted = 0;
+
+   //PRIORITIZE AN EXISTING ENTRY TO UPDATE, POSSIBLY OF AN OLDER
+   //GENERATION, OTHERWISE TAKE THE FIRST FREE/INVALID WAY
+   int victim = tlb_find_way(tlb, base, tlb_match_key(pid, pgnum), TLB_MATCH_MASK);
+   if (victim < 0)
+      victim = tlb_find_way(tlb, base, 0, TLB_ENTRY_VALID_MASK);
+
+   //SET IS FULL, LET THE REPLACEMENT POLICY EVICT ONE OF ITS WAYS
+   if (victim < 0){
+      victim = tlb_pick_victim(tlb, base);
+      TLBMEMPHY_read(tlb, victim, evicted);
+
+      tlb->tlbstat.evictions++;
+      struct tlb_stat_struct *pidstat = tlb_pidstat(tlb, TLB_PID(*evicted));
+      if (pidstat != NULL)
+         pidstat->evictions++;
+   }
+
+   TLB_entry_t newEntry = 0;
+   set_TLB_entry(&newEntry, 1, pgnum, pid, gen, value);
+   tlb_touch(tlb, victim, &newEntry);
+   TLBMEMPHY_write(tlb, victim, newEntry);
 
-   set_TLB_entry(&victimEntry, 1, pgnum, pid, value);
-   TLBMEMPHY_write(tlb, r, victimEntry);
-   
-   // pthread_mutex_unlock(&tlb_lock);
    return 0;
 }
 
 //pgnum = -1 to invalidate all entries with pid
-int tlb_cache_invalidate(struct memphy_struct *tlb, int pid, int pgnum)
+static int tlb_level_invalidate(struct memphy_struct *tlb, int pid, int pgnum)
 {
-   /* TODO: the identify info is mapped to 
-    *      cache line by employing:
-    *      direct mapped, associated mapping etc.
-    */
-   int storageSz = tlb->maxsz / sizeof(TLB_entry_t);
-
+   int storageSz = tlb->tlbsets * tlb->tlbways;
    int found = -1;
-   int index;
-   // pthread_mutex_lock(&tlb_lock);
-   for (index = 0; index < storageSz; index++){
+   int index, first, last;
+
+   if (pgnum >= 0){
+      //A SINGLE PAGE CAN ONLY LIVE IN ITS OWN SET
+      first = tlb_set_of(tlb, pid, pgnum);
+      last = first + tlb->tlbways;
+   } else {
+      first = 0;
+      last = storageSz;
+   }
+
+   for (index = first; index < last; index++){
       TLB_entry_t entry = 0;
       TLBMEMPHY_read(tlb, index, &entry);
 
@@ -166,7 +374,91 @@ int tlb_cache_invalidate(struct memphy_struct *tlb, int pid, int pgnum)
          }
       }
    }
-   // pthread_mutex_unlock(&tlb_lock);
+
+   return found;
+}
+
+/*
+ *  The TLB of a CPU is an L1 optionally backed by an L2 (tlb->tlbl2).
+ *  With CPUTLB_L1_EXCLUSIVE an entry lives in one level at a time: an
+ *  L2 hit moves the entry up and L1 victims move down. Otherwise L1
+ *  is inclusive: fills go to both levels and an L2 eviction drops the
+ *  L1 copy as well.
+ */
+
+/*
+ *  tlb_cache_read read TLB cache device
+ *  @mp: memphy struct
+ *  @pid: process id
+ *  @gen: current TLB generation of the process
+ *  @pgnum: page number
+ *  @value: obtained value
+ */
+int tlb_cache_read(struct memphy_struct * tlb, int pid, int gen, int pgnum, int* frmnum)
+{
+   struct memphy_struct *l2 = tlb->tlbl2;
+   TLB_entry_t evicted;
+
+   tlb_level_read(tlb, pid, gen, pgnum, frmnum, 0);
+   if (*frmnum >= 0 || l2 == NULL)
+      return 0;
+
+#ifdef CPUTLB_L1_EXCLUSIVE
+   tlb_level_read(l2, pid, gen, pgnum, frmnum, 1);
+   if (*frmnum >= 0){
+      tlb_level_write(tlb, pid, gen, pgnum, *frmnum, &evicted);
+      if (evicted)
+         tlb_level_write(l2, TLB_PID(evicted), TLB_GEN(evicted),
+                         TLB_TAG(evicted), TLB_FRMNUM(evicted), &evicted);
+   }
+#else
+   tlb_level_read(l2, pid, gen, pgnum, frmnum, 0);
+   if (*frmnum >= 0)
+      tlb_level_write(tlb, pid, gen, pgnum, *frmnum, &evicted);
+#endif
+
+   return 0;
+}
+
+/*
+ *  tlb_cache_write write TLB cache device
+ *  @mp: memphy struct
+ *  @pid: process id
+ *  @gen: current TLB generation of the process
+ *  @pgnum: page number
+ *  @value: obtained value
+ */
+int tlb_cache_write(struct memphy_struct *tlb, int pid, int gen, int pgnum, int value)
+{
+   struct memphy_struct *l2 = tlb->tlbl2;
+   TLB_entry_t evicted;
+
+   if (l2 == NULL)
+      return tlb_level_write(tlb, pid, gen, pgnum, value, &evicted);
+
+#ifdef CPUTLB_L1_EXCLUSIVE
+   tlb_level_invalidate(l2, pid, pgnum);
+   tlb_level_write(tlb, pid, gen, pgnum, value, &evicted);
+   if (evicted)
+      tlb_level_write(l2, TLB_PID(evicted), TLB_GEN(evicted),
+                      TLB_TAG(evicted), TLB_FRMNUM(evicted), &evicted);
+#else
+   tlb_level_write(l2, pid, gen, pgnum, value, &evicted);
+   if (evicted)
+      tlb_level_invalidate(tlb, TLB_PID(evicted), TLB_TAG(evicted));
+   tlb_level_write(tlb, pid, gen, pgnum, value, &evicted);
+#endif
+
+   return 0;
+}
+
+//pgnum = -1 to invalidate all entries with pid, in every level
+int tlb_cache_invalidate(struct memphy_struct *tlb, int pid, int pgnum)
+{
+   int found = tlb_level_invalidate(tlb, pid, pgnum);
+
+   if (tlb->tlbl2 != NULL && tlb_level_invalidate(tlb->tlbl2, pid, pgnum) == 0)
+      found = 0;
 
    return found;
 }
@@ -241,11 +533,133 @@ int TLBMEMPHY_dump(struct memphy_struct * tlb)
  */
 int init_tlbmemphy(struct memphy_struct *mp, int max_size)
 {
-   // pthread_mutex_init(&tlb_lock, NULL);
-   mp->storage = (BYTE *)malloc(max_size*sizeof(BYTE));
+   int nentries = max_size / sizeof(TLB_entry_t);
+
+   /* Entries start out invalid */
+   mp->storage = (BYTE *)calloc(max_size, sizeof(BYTE));
    mp->maxsz = max_size;
 
    mp->rdmflg = 1;
+   mp->tlbl2 = NULL;
+   tlb_lookup_init();
+
+   /* Split the entries into sets of CPUTLB_NWAYS ways, leftover
+    * entries that do not fill a whole set are not used */
+   mp->tlbways = (CPUTLB_NWAYS > 0 && CPUTLB_NWAYS < nentries) ? CPUTLB_NWAYS : nentries;
+   if (mp->tlbways <= 0)
+      mp->tlbways = 1;
+   mp->tlbsets = nentries / mp->tlbways;
+   if (mp->tlbsets <= 0)
+      mp->tlbsets = 1;
+
+   mp->tlbhand = (int *)calloc(mp->tlbsets, sizeof(int));
+   mp->tlbstamp = (unsigned long *)calloc(mp->tlbsets * mp->tlbways, sizeof(unsigned long));
+   mp->tlbtick = 0;
+   mp->tlbpolicy = TLB_REPL_RANDOM;
+
+   memset(&mp->tlbstat, 0, sizeof(struct tlb_stat_struct));
+   mp->tlbpidstat = NULL;
+   mp->tlbpidstat_sz = 0;
+
+   mp->tlbsd = (struct tlb_shootdown_struct *)malloc(TLB_SHOOTDOWN_BATCH * sizeof(struct tlb_shootdown_struct));
+   mp->tlbsd_cnt = 0;
+   mp->tlbsd_overflow = 0;
+
+   return 0;
+}
+
+/*
+ *  Release what init_tlbmemphy and the per-PID statistics allocated
+ */
+int free_tlbmemphy(struct memphy_struct *mp)
+{
+   free(mp->storage);
+   free(mp->tlbhand);
+   free(mp->tlbstamp);
+   free(mp->tlbpidstat);
+   free(mp->tlbsd);
+   mp->storage = NULL;
+   mp->tlbhand = NULL;
+   mp->tlbstamp = NULL;
+   mp->tlbpidstat = NULL;
+   mp->tlbpidstat_sz = 0;
+   mp->tlbsd = NULL;
+
+   return 0;
+}
+
+/*
+ *  tlb_policy_by_name - map a config file keyword to a TLB_REPL_* policy
+ *  Return -1 for unknown keywords
+ */
+int tlb_policy_by_name(const char *name)
+{
+   if (!strcmp(name, "random"))
+      return TLB_REPL_RANDOM;
+   if (!strcmp(name, "lru"))
+      return TLB_REPL_LRU;
+   if (!strcmp(name, "clock"))
+      return TLB_REPL_CLOCK;
+   return -1;
+}
+
+int tlb_set_policy(struct memphy_struct *tlb, int policy)
+{
+   if (policy < TLB_REPL_RANDOM || policy > TLB_REPL_CLOCK)
+      return -1;
+
+   tlb->tlbpolicy = policy;
+   return 0;
+}
+
+/*
+ *  tlb_level_stat - print global and per-pid counters of one TLB level
+ */
+static void tlb_level_stat(struct memphy_struct *tlb, const char *level)
+{
+   static const char *policy_name[] = { "random", "lru", "clock" };
+   struct tlb_stat_struct *st = &tlb->tlbstat;
+   unsigned long lookups = st->hits + st->misses;
+
+   printf("TLB_STAT%s: %d sets x %d ways, policy %s, %s lookup\n",
+          level, tlb->tlbsets, tlb->tlbways, policy_name[tlb->tlbpolicy], tlb_find_name);
+   printf("TLB_STAT%s: hits %lu misses %lu evictions %lu shootdowns %lu hit-rate %.2f%%\n",
+          level, st->hits, st->misses, st->evictions, st->shootdowns,
+          lookups ? 100.0 * st->hits / lookups : 0.0);
+
+   for (int pid = 0; pid < tlb->tlbpidstat_sz; pid++){
+      st = &tlb->tlbpidstat[pid];
+      lookups = st->hits + st->misses;
+      if (lookups == 0 && st->evictions == 0)
+         continue;
+      printf("TLB_STAT%s: PID %d hits %lu misses %lu evictions %lu hit-rate %.2f%%\n",
+             level, pid, st->hits, st->misses, st->evictions,
+             lookups ? 100.0 * st->hits / lookups : 0.0);
+   }
+}
+
+/*
+ *  tlb_cache_stat - print the counters of every level of a TLB and,
+ *  for two levels, the average translation cost they add up to
+ */
+int tlb_cache_stat(struct memphy_struct *tlb)
+{
+   struct memphy_struct *l2 = tlb->tlbl2;
+
+   if (l2 == NULL){
+      tlb_level_stat(tlb, "");
+      return 0;
+   }
+
+   tlb_level_stat(tlb, " L1");
+   tlb_level_stat(l2, " L2");
+
+   unsigned long lookups = tlb->tlbstat.hits + tlb->tlbstat.misses;
+   unsigned long cycles = lookups * TLB_L1_LATENCY
+                        + tlb->tlbstat.misses * TLB_L2_LATENCY
+                        + l2->tlbstat.misses * TLB_WALK_LATENCY;
+   printf("TLB_STAT: average translation %.2f cycles\n",
+          lookups ? (double)cycles / lookups : 0.0);
 
    return 0;
 }
@@ -1,5 +1,8 @@
 
 #include "loader.h"
+#ifdef CPU_TLB
+#include "cpu-tlbcache.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,7 +47,17 @@ static enum ins_opcode_t get_opcode(char *opt)
 struct pcb_t *load(const char *path)
 {
 	/* Create new PCB for the new process */
-	struct pcb_t *proc = (struct pcb_t *)malloc(sizeof(struct pcb_t));
+	struct pcb_t *proc = (struct pcb_t *)calloc(1, sizeof(struct pcb_t));
+#ifdef CPU_TLB
+	/* A TLB entry holds pids up to TLB_MAX_PID, a larger one would
+	 * alias a smaller pid and hit its entries */
+	if (avail_pid > TLB_MAX_PID)
+	{
+		printf("Cannot load '%s', pids above %d do not fit a TLB entry\n",
+			   path, TLB_MAX_PID);
+		exit(1);
+	}
+#endif
 	proc->pid = avail_pid;
 	avail_pid++;
 	proc->page_table =
@@ -60,7 +73,9 @@ struct pcb_t *load(const char *path)
 		exit(1);
 	}
 	char opcode[10];
-	proc->code = (struct code_seg_t *)malloc(sizeof(struct code_seg_t));
+	/* Zeroed with the PCB, so a description that cannot be parsed
+	 * loads as an empty process */
+	proc->code = (struct code_seg_t *)calloc(1, sizeof(struct code_seg_t));
 	fscanf(file, "%u %u", &proc->priority, &proc->code->size);
 	proc->code->text = (struct inst_t *)malloc(
 		sizeof(struct inst_t) * proc->code->size);
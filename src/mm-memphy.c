@@ -7,25 +7,67 @@
 #include "mm.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <pthread.h>
-static pthread_mutex_t memphy_lock;
 /*
  *  MEMPHY_mv_csr - move MEMPHY cursor
  *  @mp: memphy struct
  *  @offset: offset
+ *
+ *  The head of a sequential device travels from its current position
+ *  to [offset]. The simulator jumps there directly and only accounts
+ *  for the distance and the time it would have taken.
  */
 int MEMPHY_mv_csr(struct memphy_struct *mp, int offset)
 {
-   int numstep = 0;
+   int target = (mp->maxsz > 0) ? offset % mp->maxsz : 0;
+   int dist = (target > mp->cursor) ? target - mp->cursor : mp->cursor - target;
 
-   mp->cursor = 0;
-   while(numstep < offset && numstep < mp->maxsz){
-     /* Traverse sequentially */
-     mp->cursor = (mp->cursor + 1) % mp->maxsz;
-     numstep++;
-   }
+   mp->seeks++;
+   mp->seekdist += dist;
+   mp->seektime += (unsigned long)dist * mp->seeklat;
+   mp->cursor = target;
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_set_seek_latency - time a sequential device spends per byte
+ *  its head travels
+ */
+int MEMPHY_set_seek_latency(struct memphy_struct *mp, int lat)
+{
+   if (mp == NULL || lat < 0)
+     return -1;
+
+   mp->seeklat = lat;
+   return 0;
+}
+
+/*
+ *  MEMPHY_seek_stat - print the seek counters of a sequential device
+ */
+int MEMPHY_seek_stat(struct memphy_struct *mp, const char *name)
+{
+   if (mp == NULL || mp->rdmflg)
+     return -1;
+
+   printf("MEMPHY_STAT %s: seeks %lu distance %lu bytes time %lu (%d per byte)\n",
+          name, mp->seeks, mp->seekdist, mp->seektime, mp->seeklat);
+   return 0;
+}
+
+/*
+ *  MEMPHY_frame_stat - print how many frames were in use at the peak
+ */
+int MEMPHY_frame_stat(struct memphy_struct *mp, const char *name)
+{
+   if (mp == NULL || mp->fpcount <= 0)
+     return -1;
 
+   printf("MEMPHY_STAT %s: peak %d of %d frames in use\n",
+          name, mp->fpcount - mp->fpminfree, mp->fpcount);
    return 0;
 }
 
@@ -40,11 +82,14 @@ int MEMPHY_seq_read(struct memphy_struct *mp, int addr, BYTE *value)
    if (mp == NULL)
      return -1;
 
-   if (!mp->rdmflg)
+   if (mp->rdmflg)
      return -1; /* Not compatible mode for sequential read */
 
+   MEMPHY_lock(mp);
    MEMPHY_mv_csr(mp, addr);
    *value = (BYTE) mp->storage[addr];
+   mp->cursor = (addr + 1) % mp->maxsz;
+   MEMPHY_unlock(mp);
 
    return 0;
 }
@@ -80,11 +125,14 @@ int MEMPHY_seq_write(struct memphy_struct * mp, int addr, BYTE value)
    if (mp == NULL)
      return -1;
 
-   if (!mp->rdmflg)
-     return -1; /* Not compatible mode for sequential read */
+   if (mp->rdmflg)
+     return -1; /* Not compatible mode for sequential write */
 
+   MEMPHY_lock(mp);
    MEMPHY_mv_csr(mp, addr);
    mp->storage[addr] = value;
+   mp->cursor = (addr + 1) % mp->maxsz;
+   MEMPHY_unlock(mp);
 
    return 0;
 }
@@ -97,21 +145,160 @@ int MEMPHY_seq_write(struct memphy_struct * mp, int addr, BYTE value)
  */
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data)
 {
-   // pthread_mutex_lock(&memphy_lock);
-   if (mp == NULL){
-      // pthread_mutex_unlock(&memphy_lock);
+   if (mp == NULL)
      return -1;
-   }
 
    if (mp->rdmflg)
       mp->storage[addr] = data;
    else /* Sequential access device */
       return MEMPHY_seq_write(mp, addr, data);
-   
-   // pthread_mutex_unlock(&memphy_lock);
+
+   return 0;
+}
+
+/*
+ *  Frame transfer
+ *  Whole frames move with one memcpy. A sequential device pays a
+ *  single cursor seek to the start of the frame, then streams the
+ *  frame and leaves its cursor right behind it.
+ */
+
+/*
+ *  MEMPHY_frame_addr - seek to frame [fpn], return its first address
+ *  or -1 when the frame is outside the device
+ *  The content of the frame belongs to the page in it, only the seek
+ *  is done under the device lock.
+ */
+static int MEMPHY_frame_addr(struct memphy_struct *mp, int fpn)
+{
+   int addr;
+
+   if (mp == NULL || fpn < 0 || (fpn + 1) * PAGING_PAGESZ > mp->maxsz)
+     return -1;
+
+   addr = fpn * PAGING_PAGESZ;
+   if (!mp->rdmflg)
+   {
+      MEMPHY_lock(mp);
+      MEMPHY_mv_csr(mp, addr);
+      mp->cursor = (addr + PAGING_PAGESZ) % mp->maxsz;
+      MEMPHY_unlock(mp);
+   }
+   return addr;
+}
+
+/*
+ *  MEMPHY_read_frame - copy frame [fpn] out to [buf]
+ */
+int MEMPHY_read_frame(struct memphy_struct *mp, int fpn, BYTE *buf)
+{
+   int addr = MEMPHY_frame_addr(mp, fpn);
+
+   if (addr < 0)
+     return -1;
+
+   memcpy(buf, mp->storage + addr, PAGING_PAGESZ);
+   return 0;
+}
+
+/*
+ *  MEMPHY_write_frame - copy [buf] into frame [fpn]
+ */
+int MEMPHY_write_frame(struct memphy_struct *mp, int fpn, const BYTE *buf)
+{
+   int addr = MEMPHY_frame_addr(mp, fpn);
+
+   if (addr < 0)
+     return -1;
+
+   memcpy(mp->storage + addr, buf, PAGING_PAGESZ);
+   return 0;
+}
+
+/*
+ *  MEMPHY_read_frames - copy [n] frames out to [buf], back to back
+ */
+int MEMPHY_read_frames(struct memphy_struct *mp, int n, const int *fpns, BYTE *buf)
+{
+   int i;
+
+   for (i = 0; i < n; i++)
+      if (MEMPHY_read_frame(mp, fpns[i], buf + i * PAGING_PAGESZ) != 0)
+         return -1;
+   return 0;
+}
+
+/*
+ *  MEMPHY_write_frames - copy [n] back to back frames of [buf] in
+ */
+int MEMPHY_write_frames(struct memphy_struct *mp, int n, const int *fpns, const BYTE *buf)
+{
+   int i;
+
+   for (i = 0; i < n; i++)
+      if (MEMPHY_write_frame(mp, fpns[i], buf + i * PAGING_PAGESZ) != 0)
+         return -1;
    return 0;
 }
 
+/*
+ *  MEMPHY_cp_frame - copy frame [srcfpn] of [src] to [dstfpn] of [dst]
+ */
+int MEMPHY_cp_frame(struct memphy_struct *src, int srcfpn,
+                    struct memphy_struct *dst, int dstfpn)
+{
+   int addrsrc = MEMPHY_frame_addr(src, srcfpn);
+   int addrdst = MEMPHY_frame_addr(dst, dstfpn);
+
+   if (addrsrc < 0 || addrdst < 0)
+     return -1;
+
+   memmove(dst->storage + addrdst, src->storage + addrsrc, PAGING_PAGESZ);
+   return 0;
+}
+
+/*
+ *  Free frame allocator
+ *  fpbitmap holds one bit per frame, set while the frame is free.
+ *  fpsummary holds one bit per fpbitmap word, set while that word has
+ *  a free frame, so finding a free frame is a find-first-set over the
+ *  summary then over one bitmap word.
+ */
+#define FP_WORD(fpn) ((fpn) / 64)
+#define FP_BIT(fpn)  (1ULL << ((fpn) % 64))
+
+static inline int MEMPHY_take_fp(struct memphy_struct *mp)
+{
+   int sw, w;
+
+   for (sw = 0; sw * 64 < mp->fpwords; sw++)
+      if (mp->fpsummary[sw])
+         break;
+   if (sw * 64 >= mp->fpwords)
+      return -1;
+
+   w = sw * 64 + __builtin_ctzll(mp->fpsummary[sw]);
+   int fpn = w * 64 + __builtin_ctzll(mp->fpbitmap[w]);
+
+   mp->fpbitmap[w] &= mp->fpbitmap[w] - 1;
+   if (mp->fpbitmap[w] == 0)
+      mp->fpsummary[FP_WORD(w)] &= ~FP_BIT(w);
+   mp->fpfree--;
+   return fpn;
+}
+
+static inline void MEMPHY_give_fp(struct memphy_struct *mp, int fpn)
+{
+   int w = FP_WORD(fpn);
+
+   if (mp->fpbitmap[w] & FP_BIT(fpn))
+      return; /* Already free */
+
+   mp->fpbitmap[w] |= FP_BIT(fpn);
+   mp->fpsummary[FP_WORD(w)] |= FP_BIT(w);
+   mp->fpfree++;
+}
+
 /*
  *  MEMPHY_format-format MEMPHY device
  *  @mp: memphy struct
@@ -120,53 +307,115 @@ int MEMPHY_format(struct memphy_struct *mp, int pagesz)
 {
     /* This setting come with fixed constant PAGESZ */
     int numfp = mp->maxsz / pagesz;
-    struct framephy_struct *newfst, *fst;
-    int iter = 0;
+    int fpn;
+
+    mp->fpbitmap = mp->fpsummary = NULL;
+    mp->fpcount = mp->fpwords = mp->fpfree = mp->fpminfree = 0;
+    mp->fprmap = NULL;
+    mp->fphand = 0;
 
     if (numfp <= 0)
       return -1;
 
-    /* Init head of free framephy list */ 
-    fst = malloc(sizeof(struct framephy_struct));
-    fst->fpn = iter;
-    mp->free_fp_list = fst;
-
-    /* We have list with first element, fill in the rest num-1 element member*/
-    for (iter = 1; iter < numfp ; iter++)
-    {
-       newfst =  malloc(sizeof(struct framephy_struct));
-       newfst->fpn = iter;
-       newfst->fp_next = NULL;
-       fst->fp_next = newfst;
-       fst = newfst;
-    }
+    mp->fpcount = numfp;
+    mp->fpwords = (numfp + 63) / 64;
+    mp->fpbitmap = calloc(mp->fpwords, sizeof(uint64_t));
+    mp->fpsummary = calloc((mp->fpwords + 63) / 64, sizeof(uint64_t));
+
+    /* Every frame starts out free */
+    for (fpn = 0; fpn < numfp; fpn++)
+       MEMPHY_give_fp(mp, fpn);
+    mp->fpminfree = mp->fpfree;
 
     return 0;
 }
 
-int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
+/*
+ *  MEMPHY_init_rmap - track which page lives in each frame
+ *  Only RAM needs it, for replacement across processes
+ */
+int MEMPHY_init_rmap(struct memphy_struct *mp)
 {
-   // pthread_mutex_lock(&memphy_lock);
-   if (mp == NULL || mp->maxsz <= 0) return -1;
+    int fpn;
 
-   struct framephy_struct *fp = mp->free_fp_list;
+    mp->fprmap = calloc(mp->fpcount, sizeof(struct framephy_struct));
+    for (fpn = 0; fpn < mp->fpcount; fpn++)
+       mp->fprmap[fpn].fpn = fpn;
 
-   if (fp == NULL){
-      // pthread_mutex_unlock(&memphy_lock);
+    return 0;
+}
+
+int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
+{
+   if (mp == NULL || mp->maxsz <= 0)
      return -1;
+
+   MEMPHY_lock(mp);
+   if (mp->fpfree == 0)
+   {
+      MEMPHY_unlock(mp);
+      return -1;
    }
 
-   *retfpn = fp->fpn;
-   mp->free_fp_list = fp->fp_next;
+   *retfpn = MEMPHY_take_fp(mp);
+   if (mp->fpfree < mp->fpminfree)
+      mp->fpminfree = mp->fpfree;
 
-   /* MEMPHY is iteratively used up until its exhausted
-    * No garbage collector acting then it not been released
-    */
-   free(fp);
-   // pthread_mutex_unlock(&memphy_lock);
+   MEMPHY_unlock(mp);
    return 0;
 }
 
+/*
+ *  MEMPHY_nr_freefp - number of free frames, a snapshot
+ */
+int MEMPHY_nr_freefp(struct memphy_struct *mp)
+{
+   int nr;
+
+   MEMPHY_lock(mp);
+   nr = mp->fpfree;
+   MEMPHY_unlock(mp);
+
+   return nr;
+}
+
+/*
+ *  MEMPHY_get_freefps - take up to [n] free frames in one call
+ *  @fpns: receives the frame numbers
+ *  Return the number of frames taken, less than [n] when the device
+ *  runs out of free frames
+ */
+int MEMPHY_get_freefps(struct memphy_struct *mp, int n, int *fpns)
+{
+   int got = 0;
+
+   if (mp == NULL || mp->maxsz <= 0)
+     return 0;
+
+   MEMPHY_lock(mp);
+   while (got < n && mp->fpfree > 0)
+   {
+      int fpn = MEMPHY_take_fp(mp);
+      int w = FP_WORD(fpn);
+
+      /* Drain the rest of the bitmap word while we are on it */
+      fpns[got++] = fpn;
+      while (got < n && mp->fpbitmap[w])
+      {
+         fpns[got++] = w * 64 + __builtin_ctzll(mp->fpbitmap[w]);
+         mp->fpbitmap[w] &= mp->fpbitmap[w] - 1;
+         mp->fpfree--;
+      }
+      if (mp->fpbitmap[w] == 0)
+         mp->fpsummary[FP_WORD(w)] &= ~FP_BIT(w);
+   }
+   if (mp->fpfree < mp->fpminfree)
+      mp->fpminfree = mp->fpfree;
+   MEMPHY_unlock(mp);
+
+   return got;
+}
+
 int MEMPHY_dump(struct memphy_struct * mp)
 {
     /*TODO dump memphy contnt mp->storage 
@@ -186,16 +435,32 @@ int MEMPHY_dump(struct memphy_struct * mp)
 
 int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
 {
-   // pthread_mutex_lock(&memphy_lock);
-   struct framephy_struct *fp = mp->free_fp_list;
-   struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+   if (mp == NULL || fpn < 0 || fpn >= mp->fpcount)
+     return -1;
 
-   /* Create new node with value fpn */
-   newnode->fpn = fpn;
-   newnode->fp_next = fp;
-   mp->free_fp_list = newnode;
+   MEMPHY_lock(mp);
+   MEMPHY_give_fp(mp, fpn);
+   MEMPHY_unlock(mp);
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_put_freefps - release [n] frames in one call
+ */
+int MEMPHY_put_freefps(struct memphy_struct *mp, int n, const int *fpns)
+{
+   int i;
+
+   if (mp == NULL)
+     return -1;
+
+   MEMPHY_lock(mp);
+   for (i = 0; i < n; i++)
+      if (fpns[i] >= 0 && fpns[i] < mp->fpcount)
+         MEMPHY_give_fp(mp, fpns[i]);
+   MEMPHY_unlock(mp);
 
-   // pthread_mutex_unlock(&memphy_lock);
    return 0;
 }
 
@@ -206,22 +471,44 @@ int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
 
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
 {
-   pthread_mutex_init(&memphy_lock, NULL);
+#ifdef SYNCH
+   pthread_mutex_init(&mp->lock, NULL);
+#endif
 
-   mp->storage = (BYTE *)malloc(max_size*sizeof(BYTE));
+   // all bytes in storage start out 0
+   mp->storage = (BYTE *)calloc(max_size, sizeof(BYTE));
    mp->maxsz = max_size;
 
-   // set all bytes in storage to 0
-   for (int i = 0; i < max_size; ++i){
-      mp->storage[i] = 0;
-   }
-
    MEMPHY_format(mp,PAGING_PAGESZ);
 
    mp->rdmflg = (randomflg != 0)?1:0;
 
-   if (!mp->rdmflg )   /* Not Ramdom acess device, then it serial device*/
-      mp->cursor = 0;
+   /* Not Ramdom acess device, then it serial device*/
+   mp->cursor = 0;
+   mp->seeklat = MEMPHY_SEEK_LATENCY;
+   mp->seeks = mp->seekdist = mp->seektime = 0;
+
+   return 0;
+}
+
+/*
+ *  Release what init_memphy and MEMPHY_init_rmap allocated
+ */
+
+int free_memphy(struct memphy_struct *mp)
+{
+   free(mp->storage);
+   free(mp->fpbitmap);
+   free(mp->fpsummary);
+   free(mp->fprmap);
+   mp->storage = NULL;
+   mp->fpbitmap = mp->fpsummary = NULL;
+   mp->fprmap = NULL;
+   mp->fpcount = mp->fpfree = 0;
+
+#ifdef SYNCH
+   pthread_mutex_destroy(&mp->lock);
+#endif
 
    return 0;
 }
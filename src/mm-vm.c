@@ -16,26 +16,168 @@
 #endif
 
 #ifdef MM_PAGING
-/*enlist_vm_freerg_list - add new rg to freerg_list
- *@mm: memory region
- *@rg_elmt: new region
+/*freerg_level - pick the skip list level of a new free region
+ *@vma: vm area
  *
+ * Each level above the first is taken with probability 1/2. The bits
+ * come from a per area xorshift, so --des runs stay reproducible.
  */
-int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct *rg_elmt)
+static int freerg_level(struct vm_area_struct *vma)
 {
-  struct vm_rg_struct *rg_node = mm->mmap->vm_freerg_list;
+  uint32_t x = vma->vm_freerg_seed;
+  int level = 1;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  vma->vm_freerg_seed = x;
+
+  while (level < PAGING_FREERG_LEVELS && (x & 1))
+  {
+    level++;
+    x >>= 1;
+  }
 
-  if (rg_elmt -> rg_start >= rg_elmt -> rg_end)
+  return level;
+}
+
+/*freerg_bin - size class of a region of [size] bytes
+ */
+static int freerg_bin(unsigned long size)
+{
+  unsigned long pages = size / PAGING_PAGESZ;
+  int bin = 0;
+
+  while ((pages >>= 1) != 0 && bin < PAGING_FREERG_BINS - 1)
+    bin++;
+
+  return bin;
+}
+
+static void freerg_bin_add(struct vm_area_struct *vma, struct vm_freerg_struct *rg)
+{
+  int bin = freerg_bin(rg->rg_end - rg->rg_start);
+
+  rg->bin_prev = NULL;
+  rg->bin_next = vma->vm_freerg_bin[bin];
+  if (rg->bin_next != NULL)
+    rg->bin_next->bin_prev = rg;
+  vma->vm_freerg_bin[bin] = rg;
+  vma->vm_freerg_binmap |= 1u << bin;
+}
+
+/* Must run before the size of [rg] changes */
+static void freerg_bin_del(struct vm_area_struct *vma, struct vm_freerg_struct *rg)
+{
+  int bin = freerg_bin(rg->rg_end - rg->rg_start);
+
+  if (rg->bin_prev != NULL)
+    rg->bin_prev->bin_next = rg->bin_next;
+  else
+    vma->vm_freerg_bin[bin] = rg->bin_next;
+  if (rg->bin_next != NULL)
+    rg->bin_next->bin_prev = rg->bin_prev;
+
+  if (vma->vm_freerg_bin[bin] == NULL)
+    vma->vm_freerg_binmap &= ~(1u << bin);
+}
+
+/*freerg_find - search the free regions of a vm area by address
+ *@vma: vm area
+ *@addr: address
+ *@pred: return, last node of each level starting below addr
+ *
+ * Returns the first free region starting at or above addr, NULL if none.
+ */
+static struct vm_freerg_struct *freerg_find(struct vm_area_struct *vma, unsigned long addr,
+                                            struct vm_freerg_struct **pred)
+{
+  struct vm_freerg_struct *rg = &vma->vm_freerg_list;
+  int l;
+
+  for (l = PAGING_FREERG_LEVELS - 1; l >= 0; l--)
+  {
+    while (rg->next[l] != NULL && rg->next[l]->rg_start < addr)
+      rg = rg->next[l];
+    pred[l] = rg;
+  }
+
+  return rg->next[0];
+}
+
+/*freerg_unlink - take a region off the skip list and free it, it must
+ *be off its bin already
+ *@pred: as returned by freerg_find() for an address up to rg_start
+ */
+static void freerg_unlink(struct vm_freerg_struct *rg, struct vm_freerg_struct **pred)
+{
+  int l;
+
+  for (l = 0; l < rg->level; l++)
+    if (pred[l]->next[l] == rg)
+      pred[l]->next[l] = rg->next[l];
+
+  free(rg);
+}
+
+/*enlist_vm_freerg_list - give a range back to the free regions of a vm area
+ *@vma: vm area
+ *@start: range start
+ *@end: range end
+ *
+ * The range is merged with the free regions right below and above it.
+ * An empty range, or one overlapping a free region, is refused.
+ */
+int enlist_vm_freerg_list(struct vm_area_struct *vma, unsigned long start, unsigned long end)
+{
+  struct vm_freerg_struct *pred[PAGING_FREERG_LEVELS];
+  struct vm_freerg_struct *head = &vma->vm_freerg_list;
+  struct vm_freerg_struct *prev, *next, *rg;
+  int l;
+
+  if (start >= end)
     return -1;
 
-  if (rg_node != NULL)
-    rg_elmt -> rg_next = rg_node;
+  next = freerg_find(vma, start, pred);
+  prev = pred[0];
 
-  /* Enlist the new region */
-  mm->mmap->vm_freerg_list = rg_elmt;
-  
-  //printf("enlist  %li %li\n",mm->mmap->vm_freerg_list -> rg_end, mm->mmap->vm_freerg_list -> rg_start);
-  
+  if ((prev != head && prev->rg_end > start) || (next != NULL && next->rg_start < end))
+    return -1;
+
+  if (prev != head && prev->rg_end == start)
+  {
+    /* Grow the region below, it swallows the one above if that touches */
+    rg = prev;
+    freerg_bin_del(vma, rg);
+    rg->rg_end = end;
+    if (next != NULL && next->rg_start == end)
+    {
+      rg->rg_end = next->rg_end;
+      freerg_bin_del(vma, next);
+      freerg_unlink(next, pred);
+    }
+  }
+  else if (next != NULL && next->rg_start == end)
+  {
+    /* Grow the region above downwards, its place in the list holds */
+    rg = next;
+    freerg_bin_del(vma, rg);
+    rg->rg_start = start;
+  }
+  else
+  {
+    rg = malloc(sizeof(struct vm_freerg_struct));
+    rg->rg_start = start;
+    rg->rg_end = end;
+    rg->level = freerg_level(vma);
+    for (l = 0; l < rg->level; l++)
+    {
+      rg->next[l] = pred[l]->next[l];
+      pred[l]->next[l] = rg;
+    }
+  }
+
+  freerg_bin_add(vma, rg);
   return 0;
 }
 
@@ -46,23 +188,122 @@ int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct *rg_elmt)
  */
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid)
 {
-  struct vm_area_struct *pvma= mm->mmap;
-
-  if(mm->mmap == NULL)
+  if (vmaid < 0 || vmaid >= PAGING_MAX_VMA)
     return NULL;
 
-  int vmait = 0;
-  
-  while (vmait < vmaid)
+  return mm->vmatbl[vmaid];
+}
+
+/*vma_lower_bound - index of the first area not ending below an address
+ *@mm: memory region
+ *@addr: address
+ *
+ * Ends ascend like starts do, so this is a plain binary search. An
+ * area ending right at addr is included, it may still be empty there.
+ */
+static int vma_lower_bound(struct mm_struct *mm, unsigned long addr)
+{
+  int lo = 0, hi = mm->map_count;
+
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+
+    if (mm->mmap[mid]->vm_end < addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/*find_vma - get the vm area an address falls in
+ *@mm: memory region
+ *@addr: address
+ *
+ */
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
+{
+  int i = vma_lower_bound(mm, addr);
+
+  //An area ending at addr comes first, the next one may start there
+  if (i < mm->map_count && mm->mmap[i]->vm_end == addr)
+    i++;
+
+  if (i < mm->map_count && mm->mmap[i]->vm_start <= addr && addr < mm->mmap[i]->vm_end)
+    return mm->mmap[i];
+
+  return NULL;
+}
+
+/*vma_overlap - check a planned range against the areas of an mm
+ *@mm: memory region
+ *@skip: area the range is planned for, not checked
+ *@vmastart: range start
+ *@vmaend: range end
+ *
+ * Empty ranges and areas still own their start, it is where they grow.
+ */
+static int vma_overlap(struct mm_struct *mm, struct vm_area_struct *skip,
+                       unsigned long vmastart, unsigned long vmaend)
+{
+  unsigned long end = vmaend > vmastart ? vmaend : vmastart + 1;
+  int i;
+
+  for (i = vma_lower_bound(mm, vmastart); i < mm->map_count; i++)
   {
-    if(pvma == NULL)
-	  return NULL;
+    struct vm_area_struct *vma = mm->mmap[i];
+    unsigned long vend = vma->vm_end > vma->vm_start ? vma->vm_end : vma->vm_start + 1;
+
+    if (vma->vm_start >= end)
+      break;
 
-    vmait++;
-    pvma = pvma->vm_next;
+    if (vma != skip && vmastart < vend)
+      return 1;
   }
 
-  return pvma;
+  return 0;
+}
+
+/*create_vm_area - add a vm area to an mm
+ *@mm: memory region
+ *@vmaid: ID of the new vm area
+ *@vmastart: vma start
+ *@vmaend: vma end, the area grows up from here
+ *
+ */
+struct vm_area_struct *create_vm_area(struct mm_struct *mm, int vmaid,
+                                      unsigned long vmastart, unsigned long vmaend)
+{
+  struct vm_area_struct *vma;
+  int i;
+
+  if (vmaid < 0 || vmaid >= PAGING_MAX_VMA || mm->vmatbl[vmaid] != NULL
+      || vmastart > vmaend || vma_overlap(mm, NULL, vmastart, vmaend))
+    return NULL;
+
+  vma = malloc(sizeof(struct vm_area_struct));
+  vma->vm_id = vmaid;
+  vma->vm_start = vmastart;
+  vma->vm_end = vmaend;
+  vma->sbrk = vmaend;
+  /* No free region yet, everything below sbrk is taken */
+  memset(&vma->vm_freerg_list, 0, sizeof(vma->vm_freerg_list));
+  vma->vm_freerg_list.level = PAGING_FREERG_LEVELS;
+  memset(vma->vm_freerg_bin, 0, sizeof(vma->vm_freerg_bin));
+  vma->vm_freerg_binmap = 0;
+  vma->vm_freerg_seed = 0x9e3779b9;
+  vma->vm_mm = mm; /*point back to vma owner */
+
+  //Keep the areas sorted by start
+  for (i = mm->map_count; i > 0 && mm->mmap[i - 1]->vm_start > vmastart; i--)
+    mm->mmap[i] = mm->mmap[i - 1];
+  mm->mmap[i] = vma;
+  mm->map_count++;
+  mm->vmatbl[vmaid] = vma;
+
+  return vma;
 }
 
 /*get_symrg_byid - get mem region by region ID
@@ -111,10 +352,10 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
     {
       // pthread_mutex_unlock(&mmvm_lock);
       //Cant map pages and frames -> Put the region back
-      enlist_vm_freerg_list(caller->mm, &rgnode);
+      free(newrg);
+      enlist_vm_freerg_list(cur_vma, rgnode.rg_start, rgnode.rg_end);
       caller->mm->symrgtbl[rgid].rg_start 
         = caller->mm->symrgtbl[rgid].rg_end = 0;
-      free(newrg);
       return -1;
     }
 
@@ -144,20 +385,41 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
 
   *alloc_addr = old_sbrk;
 
-  struct vm_area_struct *remain_rg = get_vma_by_num(caller->mm, vmaid);
-  if (old_sbrk + inc_sz < remain_rg->sbrk)
-  {
-    struct vm_rg_struct *rg_free = malloc(sizeof(struct vm_rg_struct));
-    rg_free->rg_start = old_sbrk + inc_sz;
-    rg_free->rg_end = remain_rg->sbrk;
-    enlist_vm_freerg_list(caller->mm, rg_free);
-  }
-
   // pthread_mutex_unlock(&mmvm_lock);
 
   return 0;
 }
 
+/*pte_release - give back the frame or swap slot a PTE points at, and
+ *the swap copy of a resident page
+ *@caller: owner of the page
+ *@pte: page table entry
+ *@copy: swap copy entry of the page
+ */
+static void pte_release(struct pcb_t *caller, uint32_t pte, uint32_t copy)
+{
+  if (!PAGING_PAGE_PRESENT(pte))
+    return;
+
+  if (pte & PAGING_PTE_SWAPPED_MASK)
+  {
+    //No need to bring it back only to drop it, release its swap slot
+    int swptyp = GETVAL(pte, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
+    MEMPHY_put_freefp(caller->mswp[swptyp],
+                      GETVAL(pte, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT));
+  }
+  else
+  {
+    int fpn = GETVAL(pte, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
+    mm_rmap(caller->mram, fpn, NULL, -1);
+    MEMPHY_put_freefp(caller->mram, fpn);
+  }
+
+  if (copy & PAGING_SWPCOPY_VALID_MASK)
+    MEMPHY_put_freefp(caller->mswp[GETVAL(copy, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT)],
+                      GETVAL(copy, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT));
+}
+
 /*__free - remove a region memory
  *@caller: caller
  *@vmaid: ID vm area to alloc memory region
@@ -165,37 +427,11 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
  *@size: allocated size 
  *
  */
-int clear_pgn_node(struct pcb_t * proc , int pgn){
-  struct pgn_t* prev = NULL;
-  struct pgn_t* temp = proc->mm->fifo_pgn;
-  if(temp==NULL) return -1;
-
-  while(temp != NULL){
-    if(temp->pgn == pgn){
-      //Found the node to delete
-      if(prev == NULL) 
-        proc->mm->fifo_pgn = temp->pg_next;
-      else 
-        prev->pg_next = temp->pg_next;
-      break;
-    } 
-    prev = temp;
-    temp = temp->pg_next;
-  }
-
-  //Free the node if it's found in the loop
-  if (temp != NULL) {
-    temp->pg_next = NULL;
-    free(temp);
-  }
-
-  return 0;
-}
 int __free(struct pcb_t *caller, int vmaid, int rgid)
 {
- struct vm_rg_struct *rgnode = (struct vm_rg_struct *)malloc(sizeof(struct vm_rg_struct));
+  struct vm_area_struct *cur_vma;
 
-  if (rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
+  if (get_vma_by_num(caller->mm, vmaid) == NULL || rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
     return -1;
 
   // pthread_mutex_lock(&mmvm_lock);
@@ -206,28 +442,46 @@ int __free(struct pcb_t *caller, int vmaid, int rgid)
     // pthread_mutex_unlock(&mmvm_lock);
     return -1;
   }
+  //The region goes back to the area it was carved from
+  cur_vma = find_vma(caller->mm, temp->rg_start);
+  if (cur_vma == NULL)
+    return -1;
   int inc_sz = temp->rg_end - temp->rg_start;
   int inc_amt = PAGING_PAGE_ALIGNSZ(inc_sz);
   int incnumpage = inc_amt / PAGING_PAGESZ;
   int pgn = PAGING_PGN(temp->rg_start);
 
+  //Check every page first so a bad region is left as it was
   for (int i = 0; i < incnumpage; i++)
   {
-    int fpn;
-    if (pg_getpage(caller->mm, pgn + i, &fpn, caller) != 0) return -1;
-    MEMPHY_put_freefp(caller->mram, fpn);
-    CLRBIT(caller->mm->pgd[pgn + i], PAGING_PTE_PRESENT_MASK);
-    clear_pgn_node(caller, pgn+i);
+    uint32_t *pte = pte_walk(caller->mm, pgn + i, 0);
+
+    //Neither backed nor reserved, the page was never allocated
+    if (pte == NULL || !(*pte & (PAGING_PTE_PRESENT_MASK | PAGING_PTE_RESERVE_MASK)))
+      return -1;
   }
 
-  rgnode->rg_start = temp->rg_start;
-  rgnode->rg_end = temp->rg_end;
-  rgnode->rg_next = NULL;
+  for (int i = 0; i < incnumpage; i++)
+  {
+    uint32_t *pte = pte_walk(caller->mm, pgn + i, 0);
+
+    //Resident pages leave the fifo, others are not on it
+    delist_pgn_node(caller->mm, pgn+i);
+
+    pte_release(caller, *pte, *pte_swpcopy(caller->mm, pgn + i));
+    *pte_swpcopy(caller->mm, pgn + i) = 0;
+    CLRBIT(*pte, PAGING_PTE_PRESENT_MASK);
+    CLRBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+    CLRBIT(*pte, PAGING_PTE_DIRTY_MASK);
+    CLRBIT(*pte, PAGING_PTE_RESERVE_MASK);
+  }
+
+  /*enlist the obsoleted memory region, all of its pages are unmapped */
+  enlist_vm_freerg_list(cur_vma, temp->rg_start, temp->rg_start + inc_amt);
+  dec_vma_limit(caller, cur_vma->vm_id);
   temp->rg_start = 0;
   temp->rg_end = 0;
   temp->rg_next = NULL;
-  /*enlist the obsoleted memory region */
-  enlist_vm_freerg_list(caller->mm, rgnode);
   // pthread_mutex_unlock(&mmvm_lock);
   return 0;
 }
@@ -239,10 +493,13 @@ int __free(struct pcb_t *caller, int vmaid, int rgid)
  */
 int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 {
-  int addr;
+  int addr, ret;
 
   /* By default using vmaid = 0 */
-  return __alloc(proc, 0, reg_index, size, &addr);
+  mm_lock(proc->mm);
+  ret = __alloc(proc, 0, reg_index, size, &addr);
+  mm_unlock(proc->mm);
+  return ret;
 }
 
 /*pgfree - PAGING-based free a region memory
@@ -253,7 +510,47 @@ int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 
 int pgfree_data(struct pcb_t *proc, uint32_t reg_index)
 {
-   return __free(proc, 0, reg_index);
+   int ret;
+
+   mm_lock(proc->mm);
+   ret = __free(proc, 0, reg_index);
+   mm_unlock(proc->mm);
+   return ret;
+}
+
+/*pgexit - release the address space of a finished process
+ *@proc: Process that finished
+ */
+int pgexit(struct pcb_t *proc)
+{
+   int i;
+
+   /* Once its frames are off the reverse map nobody else can find the
+    * mm, it can go as soon as evictions already in it are done */
+   mm_lock(proc->mm);
+   free_pcb_memph(proc);
+   mm_unlock(proc->mm);
+#ifdef SYNCH
+   pthread_mutex_destroy(&proc->mm->lock);
+#endif
+
+   for (i = 0; i < proc->mm->map_count; i++)
+   {
+      struct vm_area_struct *vma = proc->mm->mmap[i];
+      struct vm_freerg_struct *rg = vma->vm_freerg_list.next[0];
+
+      while (rg != NULL)
+      {
+         struct vm_freerg_struct *rgnext = rg->next[0];
+         free(rg);
+         rg = rgnext;
+      }
+      free(vma);
+   }
+
+   free(proc->mm);
+   proc->mm = NULL;
+   return 0;
 }
 
 /*pg_getpage - get the page in ram
@@ -265,94 +562,52 @@ int pgfree_data(struct pcb_t *proc, uint32_t reg_index)
  */
 int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
 {
-  uint32_t pte = mm->pgd[pgn];
+  uint32_t pte = pte_get(mm, pgn);
 
   *fpn = -1;
 
-  //Page not allocated
   if (!PAGING_PAGE_PRESENT(pte))
-    return -1;
-
-  if (GETVAL(pte, PAGING_PTE_SWAPPED_MASK, 0) > 0)
-  { 
-    /* Page is not online, make it actively living */
-
-    //Id of swap
-    int swapType = GETVAL(pte, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
-    //Offset of the frame on swap
-    int swapOff = PAGING_SWP(pte);
-    
-    //First try to find a free frame on RAM to swap in
-    if (MEMPHY_get_freefp(caller->mram, fpn) == 0){
-      //Copy from swap to the newly allocated frame in RAM
-      caller->active_mswp = (struct memphy_struct *)(caller->mswp + swapType);
-      __swap_cp_page(caller->active_mswp, swapOff, caller->mram, *fpn);
-
-      //Set the found fpn to the needed pte
-      pte_set_fpn(&mm->pgd[pgn], *fpn);
-
-      //Set the offset on swap as free
-      MEMPHY_put_freefp(caller->active_mswp, swapOff);
+  {
+#ifdef MM_DEMAND_PAGING
+    //First touch of a reserved page, back it with a zeroed frame
+    if (pte & PAGING_PTE_RESERVE_MASK)
+    {
+      if (MEMPHY_get_freefp(caller->mram, fpn) != 0 &&
+          mm_evict_page(caller, fpn) < 0)
+        return -1;
 
-      //Put pgn back to fifo_pgn list
-      enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
-      //Frame is also found, return right away;D
+      __zero_fill_page(caller, pgn, *fpn);
+      enlist_pgn_node(caller->mm, pgn);
       return 0;
     }
+#endif
+    //Page not allocated
+    return -1;
+  }
 
-    /* Find victim page */
-     int failed = 0;
-    int vicpgn = -1, vicSwapOff = -1; 
-    int vicfpn = -1;
-    uint32_t vicpte;
-    if (find_victim_page(caller->mm, &vicpgn) < 0){
-      return -1;
-    }
-
-    vicpte = mm->pgd[vicpgn];
-    vicfpn = GETVAL(vicpte, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
-  
-    int swapIndex = 0;
-    //Find a suitable frame in all swap to perform swap out
-    for (; swapIndex < PAGING_MAX_MMSWP && failed < 0; ++swapIndex){
-      caller->active_mswp = (struct memphy_struct *)(caller->mswp + swapIndex);
-      MEMPHY_get_freefp(caller->active_mswp, &vicSwapOff);
-      if (vicSwapOff >= 0) break;
-    }
+  if (pte & PAGING_PTE_SWAPPED_MASK)
+  { 
+    /* Page is not online, make it actively living */
 
-    //No frame in all swaps, get fail
-    if (vicSwapOff < 0){
+    //First try to find a free frame on RAM to swap in,
+    //otherwise make room by swapping a victim page out
+    if (MEMPHY_get_freefp(caller->mram, fpn) != 0 &&
+        mm_evict_page(caller, fpn) < 0)
       return -1;
-    }
-
-    //Swapping out
-    #ifdef CPU_TLB
-      //Invalidate the entry of the victim page on tlb
-      tlb_cache_invalidate(caller->tlb, caller->pid, vicpgn);
-    #endif
-
-    /* Do swap frame from MEMRAM to MEMSWP and vice versa*/
-    /* Copy victim frame to RECENTLY active swap from the loop */
-    __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, vicSwapOff);
-    
-    /* Copy target frame from swap to mem */
-    caller->active_mswp = caller->mswp[swapType];
-    __swap_cp_page(caller->active_mswp, swapOff, caller->mram, vicfpn);
-    //Set the swap info bits of victim page entry
-    pte_set_swap(&mm->pgd[vicpgn], swapIndex, vicSwapOff);
-
-    //Set the frame number to the needed pte
-    pte_set_fpn(&mm->pgd[pgn], vicfpn);
 
-    //Update pte after swapping-in
-    pte = mm->pgd[pgn];
+    //Copy from swap, its slot stays as a clean copy of the page
+    __swap_in_page(caller, pgn, *fpn);
 
     //Doenst store swapped out pgn in fifo_pgn list
     //So put it back in after swapping-in
-    enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
+    enlist_pgn_node(caller->mm, pgn);
+
+    //Frame is also found, return right away;D
+    return 0;
   }
 
   *fpn = GETVAL(pte, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
+  PTE_SETBIT(*pte_walk(mm, pgn, 0), PAGING_PTE_ACCESSED_MASK);
 
   return 0;
 }
@@ -399,6 +654,7 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
   int phyaddr = (fpn  << PAGING_ADDR_FPN_LOBIT) + off;
 
   MEMPHY_write(caller->mram,phyaddr, value);
+  PTE_SETBIT(*pte_walk(mm, pgn, 0), PAGING_PTE_DIRTY_MASK);
 
    return 0;
 }
@@ -443,7 +699,9 @@ int pgread(
 		uint32_t destination) 
 {
   BYTE data;
+  mm_lock(proc->mm);
   int val = __read(proc, 0, source, offset, &data);
+  mm_unlock(proc->mm);
 
   destination = (uint32_t) data;
 #ifdef IODUMP
@@ -497,7 +755,9 @@ int pgwrite(
 		uint32_t offset)
 {
 
+  mm_lock(proc->mm);
   int ret = __write(proc, 0, destination, offset, data);
+  mm_unlock(proc->mm);
 #ifdef IODUMP
   printf("write region=%d offset=%d value=%d\n", destination, offset, data);
 #ifdef PAGETBL_DUMP
@@ -512,29 +772,31 @@ int pgwrite(
 
 /*free_pcb_memphy - collect all memphy of pcb
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
- *@incpgnum: number of page
+ *
+ * Give back every frame, swap slot and swap copy the process holds,
+ * then its page table. Only the leaves that were allocated are walked.
  */
 int free_pcb_memph(struct pcb_t *caller)
 {
-  int pagenum, fpn;
-  uint32_t pte;
-
+  struct mm_struct *mm = caller->mm;
+  int l, i;
 
-  for(pagenum = 0; pagenum < PAGING_MAX_PGN; pagenum++)
+  for (l = 0; l < PAGING_PTBL_SZ; l++)
   {
-    pte= caller->mm->pgd[pagenum];
+    struct pt_leaf_struct *leaf = mm->pgd[l];
+    if (leaf == NULL)
+      continue;
 
-    if (!PAGING_PAGE_PRESENT(pte))
-    {
-      fpn = PAGING_FPN(pte);
-      MEMPHY_put_freefp(caller->mram, fpn);
-    } else {
-      fpn = PAGING_SWP(pte);
-      MEMPHY_put_freefp(caller->active_mswp, fpn);    
-    }
+    for (i = 0; i < PAGING_PTBL_SZ; i++)
+      pte_release(caller, leaf->pte[i], leaf->swpcopy[i]);
+
+    free(leaf);
+    mm->pgd[l] = NULL;
   }
 
+  //The ring was linked through the leaves
+  mm->fifo_pgn = -1;
+
   return 0;
 }
 
@@ -568,28 +830,14 @@ struct vm_rg_struct* get_vm_area_node_at_brk(struct pcb_t *caller, int vmaid, in
  */
 int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend)
 {
-  //struct vm_area_struct *vma = caller->mm->mmap;
+  struct vm_area_struct *cur_area = get_vma_by_num(caller->mm, vmaid);
 
-  /* TODO validate the planned memory area is not overlapped */
-  if (vmastart >= vmaend)
-  {
+  if (vmastart >= vmaend || cur_area == NULL)
     return -1;
-  }
-  struct vm_area_struct *vma = caller->mm->mmap;
-  struct vm_area_struct *cur_area = get_vma_by_num(caller->mm, vmaid);
-  if (cur_area == NULL)
-  {
+
+  if (vma_overlap(caller->mm, cur_area, vmastart, vmaend))
     return -1;
-  }
- //printf ("vmaid= %i - %p - %li - %p\n ",vmaid, vma, vma->vm_id, cur_area);
-  while (vma)
-  {
-    if (vma != cur_area && OVERLAP(vmastart, vmaend, vma->vm_start, vma->vm_end))
-    {
-      return -1;
-    }
-    vma = vma->vm_next;
-  }
+
   return 0;
 }
 
@@ -628,6 +876,31 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
 
 }
 
+/*dec_vma_limit - give the free region at the top of a vm area back,
+ *lowering its limit
+ *@caller: caller
+ *@vmaid: ID vm area
+ *
+ */
+int dec_vma_limit(struct pcb_t *caller, int vmaid)
+{
+  struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+  struct vm_freerg_struct *pred[PAGING_FREERG_LEVELS];
+  struct vm_freerg_struct *top;
+
+  freerg_find(cur_vma, cur_vma->sbrk, pred);
+  top = pred[0];
+  if (top == &cur_vma->vm_freerg_list || top->rg_end != cur_vma->sbrk)
+    return -1;
+
+  cur_vma->vm_end = cur_vma->sbrk = top->rg_start;
+  freerg_find(cur_vma, top->rg_start, pred);
+  freerg_bin_del(cur_vma, top);
+  freerg_unlink(top, pred);
+
+  return 0;
+}
+
 /*find_victim_page - find victim page
  *@caller: caller
  *@pgn: return page number
@@ -635,35 +908,98 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz)
  */
 int find_victim_page(struct mm_struct *mm, int *retpgn) 
 {
-  if (mm == NULL || mm->fifo_pgn == NULL){
+  if (mm == NULL || mm->fifo_pgn == -1){
     return -1;
   }
   //Fifo_pgn doesnt store swapped pages, no need for special checks
-  struct pgn_t *pg = mm->fifo_pgn;
-
-  *retpgn = -1;
-
-  /* TODO: Implement the theorical mechanism to find the victim page */
-  struct pgn_t *prev = NULL;
-  while (pg && pg->pg_next)
+  int pg = mm->fifo_pgn;
+
+#ifdef MM_PAGING_CLOCK
+  /* Second chance: sweep past pages used since the hand last saw them,
+   * clearing their accessed bit. Each page is passed at most once per
+   * eviction, and only as often as it was accessed since */
+  uint32_t *pte;
+  while (*(pte = pte_walk(mm, pg, 0)) & PAGING_PTE_ACCESSED_MASK)
   {
-    prev = pg;
-    pg = pg->pg_next;
+    PTE_CLRBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+    pg = *pgn_next(mm, pg);
   }
+#endif
 
-  if (pg)
-    *retpgn = pg->pgn;
-  else
+  /* The hand moves on to the page after the victim */
+  *retpgn = pg;
+  mm->fifo_pgn = pg;
+  delist_pgn_node(mm, pg);
+
+  return 0;
+}
+
+/*find_victim_frame - find a victim frame among the pages of every process
+ *@caller: caller
+ *@retfpn: return frame number
+ *
+ * A CLOCK hand sweeps the frames of RAM, the reverse map names the page
+ * in each. Pages of a process running on another CPU are left alone: its TLB hits skip the
+ * mm lock, so neither its frames nor its PTE bits can be touched. So are
+ * pages whose mm is busy, it is only tried under the RAM lock.
+ * Two sweeps are enough, the first clears every accessed bit it meets.
+ *
+ * The mm of the victim is returned locked when it is not the caller's.
+ */
+int find_victim_frame(struct pcb_t *caller, int *retfpn)
+{
+  struct memphy_struct *mram = caller->mram;
+  int scan;
+
+  if (mram->fprmap == NULL)
     return -1;
-  
-  if (prev) prev->pg_next = NULL;
-  else{
-    mm->fifo_pgn = NULL;
+
+  MEMPHY_lock(mram);
+  for (scan = 0; scan < 2 * mram->fpcount; scan++)
+  {
+    int fpn = mram->fphand;
+    struct framephy_struct *rmap = &mram->fprmap[fpn];
+    struct mm_struct *mm = rmap->owner;
+    uint32_t *pte;
+
+    mram->fphand = (fpn + 1) % mram->fpcount;
+
+    //Free, or taken by an allocation still in progress
+    if (mm == NULL)
+      continue;
+
+    if (mm != caller->mm && mm_trylock(mm) != 0)
+      continue;
+
+#ifdef CPU_TLB
+    //A running process sets bits on TLB hits without its mm lock and
+    //relies on its cached frames staying its own, see tlb_mark_pte()
+    if (mm->owner != caller && __atomic_load_n(&mm->owner->tlb_active, __ATOMIC_ACQUIRE))
+    {
+      mm_unlock(mm);
+      continue;
+    }
+#endif
+
+    pte = pte_walk(mm, rmap->pgn, 0);
+#ifdef MM_PAGING_CLOCK
+    if (*pte & PAGING_PTE_ACCESSED_MASK)
+    {
+      PTE_CLRBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+      if (mm != caller->mm)
+        mm_unlock(mm);
+      continue;
+    }
+#endif
+    (void)pte;
+
+    MEMPHY_unlock(mram);
+    *retfpn = fpn;
+    return 0;
   }
-  pg->pg_next = NULL;
-  free(pg);
+  MEMPHY_unlock(mram);
 
-  return 0;
+  return -1;
 }
 
 /*get_free_vmrg_area - get a free vm region
@@ -675,60 +1011,55 @@ int find_victim_page(struct mm_struct *mm, int *retpgn)
 int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg)
 {
   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+  struct vm_freerg_struct *pred[PAGING_FREERG_LEVELS];
+  struct vm_freerg_struct *rgit, *fit = NULL;
+  uint32_t binmap;
+  int bin;
 
-  struct vm_rg_struct *rgit = cur_vma->vm_freerg_list;
-
-  if (rgit == NULL)
+  if (cur_vma == NULL || size <= 0)
     return -1;
 
-  /* Probe unintialized newrg */
-  newrg->rg_start = newrg->rg_end = -1;
-
-  /* Traverse on list of free vm region to find a fit space */
-  while (rgit != NULL)
+  /* Best fit among the regions of the size class of the request,
+   * which may all be too small */
+  bin = freerg_bin(size);
+  for (rgit = cur_vma->vm_freerg_bin[bin]; rgit != NULL; rgit = rgit->bin_next)
   {
-    if (rgit->rg_start + size <= rgit->rg_end)
-    { /* Current region has enough space */
-      newrg->rg_start = rgit->rg_start;
-      newrg->rg_end = rgit->rg_start + size;
+    unsigned long rgsz = rgit->rg_end - rgit->rg_start;
 
-      /* Update left space in chosen region */
-      if (rgit->rg_start + size < rgit->rg_end)
-      {
-        rgit->rg_start = rgit->rg_start + size;
-      }
-      else
-      { /*Use up all space, remove current node */
-        /*Clone next rg node */
-        struct vm_rg_struct *nextrg = rgit->rg_next;
-
-        /*Cloning */
-        if (nextrg != NULL)
-        {
-          rgit->rg_start = nextrg->rg_start;
-          rgit->rg_end = nextrg->rg_end;
-
-          rgit->rg_next = nextrg->rg_next;
-
-          free(nextrg);
-        }
-        else
-        { /*End of free list */
-          rgit->rg_start = rgit->rg_end;	//dummy, size 0 region
-          rgit->rg_next = NULL;
-        }
-      }
-    }
-    else
+    if (rgsz >= size && (fit == NULL || rgsz < fit->rg_end - fit->rg_start))
     {
-      rgit = rgit->rg_next;	// Traverse next rg
+      fit = rgit;
+      if (rgsz == size)
+        break;
     }
   }
 
- if(newrg->rg_start == -1) // new region not found
-   return -1;
+  /* Any region of a larger class fits, take the smallest class */
+  binmap = cur_vma->vm_freerg_binmap & ~((2u << bin) - 1);
+  if (fit == NULL && binmap != 0)
+    fit = cur_vma->vm_freerg_bin[__builtin_ctz(binmap)];
+
+  if (fit == NULL)
+    return -1;
+
+  newrg->rg_start = fit->rg_start;
+  newrg->rg_end = fit->rg_start + size;
+  newrg->rg_next = NULL;
+
+  /* Carve from the bottom, the rest keeps its place in address order */
+  freerg_bin_del(cur_vma, fit);
+  if (fit->rg_end - fit->rg_start == size)
+  {
+    freerg_find(cur_vma, fit->rg_start, pred);
+    freerg_unlink(fit, pred);
+  }
+  else
+  {
+    fit->rg_start += size;
+    freerg_bin_add(cur_vma, fit);
+  }
 
- return 0;
+  return 0;
 }
 
 #endif
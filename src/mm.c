@@ -7,6 +7,7 @@
 #include "mm.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef CPU_TLB
 #include "cpu-tlbcache.h"
@@ -73,6 +74,8 @@ int pte_set_fpn(uint32_t *pte, int fpn)
 {
   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
   CLRBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  /* Drop the swap offset, its high bits overlap the resident flags */
+  CLRBIT(*pte, PAGING_PTE_SWPOFF_MASK);
 
   SETVAL(*pte, fpn, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT); 
 
@@ -80,6 +83,55 @@ int pte_set_fpn(uint32_t *pte, int fpn)
 }
 
 
+/*
+ * pte_walk - find the PTE of a page in the page table
+ * @mm    : address space
+ * @pgn   : page number
+ * @alloc : allocate the leaf covering the page if it is missing
+ *
+ * Return NULL when the page has no leaf and alloc is 0, when the leaf
+ * cannot be allocated, or when pgn is out of range.
+ */
+uint32_t *pte_walk(struct mm_struct *mm, int pgn, int alloc)
+{
+  struct pt_leaf_struct **leaf;
+
+  if (pgn < 0 || pgn >= PAGING_MAX_PGN)
+    return NULL;
+
+  leaf = &mm->pgd[PAGING_PGD_IDX(pgn)];
+  if (*leaf == NULL)
+  {
+    if (!alloc)
+      return NULL;
+    *leaf = calloc(1, sizeof(struct pt_leaf_struct));
+    if (*leaf == NULL)
+      return NULL;
+    memset((*leaf)->pg_next, -1, sizeof((*leaf)->pg_next));
+    memset((*leaf)->pg_prev, -1, sizeof((*leaf)->pg_prev));
+  }
+
+  return &(*leaf)->pte[PAGING_PTBL_IDX(pgn)];
+}
+
+/*
+ * pte_get - value of the PTE of a page, 0 if it was never mapped
+ */
+uint32_t pte_get(struct mm_struct *mm, int pgn)
+{
+  uint32_t *pte = pte_walk(mm, pgn, 0);
+
+  return (pte != NULL) ? *pte : 0;
+}
+
+/*
+ * pte_swpcopy - swap copy entry of a page, its leaf must exist
+ */
+uint32_t *pte_swpcopy(struct mm_struct *mm, int pgn)
+{
+  return &mm->pgd[PAGING_PGD_IDX(pgn)]->swpcopy[PAGING_PTBL_IDX(pgn)];
+}
+
 /* 
  * vmap_page_range - map a range of page at aligned address
  */
@@ -97,16 +149,39 @@ int vmap_page_range(struct pcb_t *caller, // process call
 
   ret_rg->rg_end = ret_rg->rg_start = addr; // at least the very first space is usable
 
+  /* Get every leaf first so a failure leaves nothing half mapped */
+  for (; pgit < pgnum; ++pgit)
+  {
+    if (pte_walk(caller->mm, pgn + pgit, 1) == NULL)
+    {
+      free(fpit);
+      while (frames != NULL)
+      {
+        fpit = frames;
+        MEMPHY_put_freefp(caller->mram, fpit->fpn);
+        frames = frames->fp_next;
+        free(fpit);
+      }
+      return -1;
+    }
+  }
+
   fpit->fp_next = frames;
 
   /* TODO map range of frame to address space 
    *      [addr to addr + pgnum*PAGING_PAGESZ
    *      in page table caller->mm->pgd[]
    */
-  for (; pgit < pgnum; ++pgit)
+  for (pgit = 0; pgit < pgnum; ++pgit)
   {
+    uint32_t *pte = pte_walk(caller->mm, pgn + pgit, 0);
+
     fpit = frames;
-    pte_set_fpn(&caller->mm->pgd[pgn + pgit], fpit->fpn);
+    pte_set_fpn(pte, fpit->fpn);
+    PTE_CLRBIT(*pte, PAGING_PTE_DIRTY_MASK);
+    PTE_SETBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+    *pte_swpcopy(caller->mm, pgn + pgit) = 0;
+    mm_rmap(caller->mram, fpit->fpn, caller->mm, pgn + pgit);
 
     #ifdef IODUMP
     printf("========PID: %d ADDR: %d --- PAGE: %d ----> FRAME: %d\n",caller->pid, addr, pgn + pgit, fpit->fpn);
@@ -116,7 +191,7 @@ int vmap_page_range(struct pcb_t *caller, // process call
     free(fpit);
    /* Tracking for later page replacement activities (if needed)
     * Enqueue new usage page */
-   enlist_pgn_node(&caller->mm->fifo_pgn, pgn+pgit);
+   enlist_pgn_node(caller->mm, pgn+pgit);
   }
 
   return 0;
@@ -131,24 +206,28 @@ int vmap_page_range(struct pcb_t *caller, // process call
 
 int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struct** frm_lst)
 {
-  int pgit, fpn;
+  int pgit, nr_free;
   //struct framephy_struct *newfp_str;
 
   struct framephy_struct *newfp_str = NULL;
 
+  /* Take whatever free frames RAM has in one go, swap out for the rest */
+  int *fpns = malloc(req_pgnum * sizeof(int));
+  nr_free = MEMPHY_get_freefps(caller->mram, req_pgnum, fpns);
+
   for (pgit = 0; pgit < req_pgnum; pgit++)
   {
     newfp_str = (struct framephy_struct *)malloc(sizeof(struct framephy_struct));
-    if (MEMPHY_get_freefp(caller->mram, &fpn) == 0)
+    if (pgit < nr_free)
     {
-      newfp_str->fpn = fpn;
+      newfp_str->fpn = fpns[pgit];
     }
     else
     { // ERROR CODE of obtaining somes but not enough frames
-      //Try to find a victim page of the same process to swap out
-      int vicpgn = -1, vicfpn = -1, vicSwapOff = -1;
+      //Try to find a victim page to swap out
+      int vicfpn = -1;
 
-      if (find_victim_page(caller->mm, &vicpgn) < 0){
+      if (mm_evict_page(caller, &vicfpn) < 0){
         struct framephy_struct *freefp_str;
         struct framephy_struct *frm_lst_iter = *(frm_lst);
         while (frm_lst_iter != NULL){
@@ -158,51 +237,18 @@ int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struc
           frm_lst_iter = frm_lst_iter->fp_next;
           free(freefp_str);
         }
+        free(newfp_str);
+        free(fpns);
         return -3000;
       }
-      
-      int swapIndex = 0;
-      //Find a suitable frame in all swap to perform swap out
-      for (; swapIndex < PAGING_MAX_MMSWP; ++swapIndex){
-        caller->active_mswp = (struct memphy_struct *)(caller->mswp + swapIndex);
-        MEMPHY_get_freefp(caller->active_mswp, &vicSwapOff);
-        if (vicSwapOff >= 0) break;
-      }
-
-      //No frame in all swaps, get fail
-      if (vicSwapOff < 0){
-        struct framephy_struct *freefp_str;
-        while (newfp_str != NULL){
-          MEMPHY_put_freefp(caller->mram, newfp_str->fpn);
-          
-          freefp_str = newfp_str;
-          newfp_str = newfp_str->fp_next;
-          free(freefp_str);
-        }
-        return -3000;
-      }
-
-      //Victim page found, swapping out
 
-      #ifdef CPU_TLB
-        //Invalidate the entry of the victim page on tlb
-        tlb_cache_invalidate(caller->tlb, caller->pid, vicpgn);
-      #endif
-
-      uint32_t vicpte = caller->mm->pgd[vicpgn];
-      vicfpn = GETVAL(vicpte, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
-
-      //Swap out to the RECENTLY active swap
-      printf("-------------__>Active swap id: %d\n", swapIndex);
-      __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, vicSwapOff);
-
-      pte_set_swap(&caller->mm->pgd[vicpgn], swapIndex, vicSwapOff);
       newfp_str->fpn = vicfpn;
     }
     newfp_str->fp_next = *frm_lst;
     *frm_lst = newfp_str;
   }
 
+  free(fpns);
   return 0;
 }
 
@@ -221,6 +267,23 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
   struct framephy_struct *frm_lst = NULL;
   int ret_alloc;
 
+#ifdef MM_DEMAND_PAGING
+  /* Only reserve the pages, pg_getpage backs each one on first touch */
+  int pgit, pgn = PAGING_PGN(mapstart);
+
+  ret_rg->rg_end = ret_rg->rg_start = mapstart;
+  /* Get every leaf first so a failure reserves nothing */
+  for (pgit = 0; pgit < incpgnum; pgit++)
+    if (pte_walk(caller->mm, pgn + pgit, 1) == NULL)
+      return -1;
+  for (pgit = 0; pgit < incpgnum; pgit++)
+  {
+    *pte_walk(caller->mm, pgn + pgit, 0) = PAGING_PTE_RESERVE_MASK;
+    *pte_swpcopy(caller->mm, pgn + pgit) = 0;
+  }
+  return 0;
+#endif
+
   /*@bksysnet: author provides a feasible solution of getting frames
    *FATAL logic in here, wrong behaviour if we have not enough page
    *i.e. we request 1000 frames meanwhile our RAM has size of 3 frames
@@ -244,7 +307,8 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
 
   /* it leaves the case of memory is enough but half in ram, half in swap
    * do the swaping all to swapper to get the all in ram */
-  vmap_page_range(caller, mapstart, incpgnum, frm_lst, ret_rg);
+  if (vmap_page_range(caller, mapstart, incpgnum, frm_lst, ret_rg) < 0)
+    return -1;
 
   return 0;
 }
@@ -261,21 +325,288 @@ int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
   #ifdef MMDBG
     printf("Swapping frames: %d -> %d\n", srcfpn, dstfpn);
   #endif
-  int cellidx;
-  int addrsrc,addrdst;
-  for(cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++)
+  return MEMPHY_cp_frame(mpsrc, srcfpn, mpdst, dstfpn);
+}
+
+/*
+ * Swap traffic counters, CPUs fault in parallel so they are atomics
+ */
+static struct {
+  unsigned long swapins;
+  unsigned long swapouts;         /* victims written to swap */
+  unsigned long clean_evictions;  /* victims dropped, swap copy still valid */
+  unsigned long stolen;           /* victims owned by another process */
+  unsigned long direct;           /* evictions done by a faulting process */
+  unsigned long background;       /* evictions done by kswapd */
+  unsigned long zerofills;        /* pages backed on first touch */
+} swap_stat;
+
+/* 
+ * mm_rmap - record the page held in a RAM frame
+ * @mram : RAM
+ * @fpn  : frame
+ * @mm   : owner of the page, NULL when the frame stops holding one
+ * @pgn  : page number
+ */
+void mm_rmap(struct memphy_struct *mram, int fpn, struct mm_struct *mm, int pgn)
+{
+  if (mram->fprmap == NULL)
+    return;
+
+  MEMPHY_lock(mram);
+  mram->fprmap[fpn].owner = mm;
+  mram->fprmap[fpn].pgn = pgn;
+  MEMPHY_unlock(mram);
+}
+
+/* 
+ * mm_get_swap_slot - take a free frame on the first swap device that has one
+ * @owner  : process the slot is for
+ * @swptyp : returned swap device index
+ * @swpoff : returned frame on that device
+ *
+ * When every device is full, give up the swap copy of a resident page
+ * of the owner: that page simply counts as dirty afterwards.
+ */
+static int mm_get_swap_slot(struct pcb_t *owner, int *swptyp, int *swpoff)
+{
+  int l, i;
+
+  for (*swptyp = 0; *swptyp < PAGING_MAX_MMSWP; (*swptyp)++)
+    if (MEMPHY_get_freefp(owner->mswp[*swptyp], swpoff) == 0)
+      return 0;
+
+  for (l = 0; l < PAGING_PTBL_SZ; l++)
+  {
+    struct pt_leaf_struct *leaf = owner->mm->pgd[l];
+    if (leaf == NULL)
+      continue;
+
+    for (i = 0; i < PAGING_PTBL_SZ; i++)
+    {
+      uint32_t copy = leaf->swpcopy[i];
+      if (copy & PAGING_SWPCOPY_VALID_MASK)
+      {
+        *swptyp = GETVAL(copy, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
+        *swpoff = GETVAL(copy, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT);
+        leaf->swpcopy[i] = 0;
+        return 0;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/* 
+ * __swap_out_page - evict a resident page to swap
+ * @caller : caller, running on the current CPU
+ * @owner  : process owning the victim, the caller or one not running
+ * @vicpgn : victim page number, already taken off the fifo
+ * @vicfpn : returned frame the victim leaves free
+ *
+ * A victim that was not written since it was swapped in still has an
+ * up to date copy on swap: its PTE is pointed back at that copy and
+ * nothing is written. Otherwise the page is written to its old slot
+ * if it has one, or to a newly taken one.
+ */
+int __swap_out_page(struct pcb_t *caller, struct pcb_t *owner, int vicpgn, int *vicfpn)
+{
+  struct mm_struct *mm = owner->mm;
+  uint32_t *pte = pte_walk(mm, vicpgn, 0);
+  uint32_t vicpte = *pte;
+  uint32_t copy = *pte_swpcopy(mm, vicpgn);
+  int swptyp, swpoff;
+
+  *vicfpn = GETVAL(vicpte, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
+
+  if (copy & PAGING_SWPCOPY_VALID_MASK)
+  {
+    swptyp = GETVAL(copy, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
+    swpoff = GETVAL(copy, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT);
+  }
+  else if (mm_get_swap_slot(owner, &swptyp, &swpoff) < 0)
+    return -1;
+
+#ifdef CPU_TLB
+  //Invalidate the entry of the victim page on every tlb
+  tlb_shootdown(caller->tlb, owner, vicpgn);
+#endif
+
+  //kswapd has no mm of its own
+  if (owner != caller && caller->mm != NULL)
+    __atomic_fetch_add(&swap_stat.stolen, 1, __ATOMIC_RELAXED);
+
+  caller->active_mswp = caller->mswp[swptyp];
+  if ((copy & PAGING_SWPCOPY_VALID_MASK) && !(vicpte & PAGING_PTE_DIRTY_MASK))
+  {
+  #ifdef MMDBG
+    printf("Dropping clean page %d, copy on swap %d:%d\n", vicpgn, swptyp, swpoff);
+  #endif
+    __atomic_fetch_add(&swap_stat.clean_evictions, 1, __ATOMIC_RELAXED);
+  }
+  else
   {
-    addrsrc = srcfpn * PAGING_PAGESZ + cellidx;
-    addrdst = dstfpn * PAGING_PAGESZ + cellidx;
-
-    BYTE data;
-    MEMPHY_read(mpsrc, addrsrc, &data);
-    // #ifdef MMDBG
-    //   printf("Transfering data: %d\n", data);
-    // #endif
-    MEMPHY_write(mpdst, addrdst, data);
+    __swap_cp_page(caller->mram, *vicfpn, caller->active_mswp, swpoff);
+    __atomic_fetch_add(&swap_stat.swapouts, 1, __ATOMIC_RELAXED);
   }
 
+  PTE_CLRBIT(*pte, PAGING_PTE_DIRTY_MASK);
+  pte_set_swap(pte, swptyp, swpoff);
+  *pte_swpcopy(mm, vicpgn) = 0;
+  mm_rmap(caller->mram, *vicfpn, NULL, -1);
+
+  return 0;
+}
+
+/* 
+ * mm_evict_page - free a RAM frame for the caller by evicting a page
+ * @caller : caller
+ * @vicfpn : returned frame
+ *
+ * With MM_PAGING_GLOBAL the victim can be a page of any process, found
+ * through the reverse map of RAM. Otherwise it is one of the caller's.
+ * The caller holds its own mm lock, if it has an mm.
+ */
+int mm_evict_page(struct pcb_t *caller, int *vicfpn)
+{
+  struct pcb_t *owner = caller;
+  int vicpgn = -1;
+
+#ifdef MM_PAGING_GLOBAL
+  struct framephy_struct *rmap;
+
+  if (find_victim_frame(caller, vicfpn) < 0)
+    return -1;
+
+  //The owner is locked, its entry in the reverse map stays put
+  rmap = &caller->mram->fprmap[*vicfpn];
+  owner = rmap->owner->owner;
+  vicpgn = rmap->pgn;
+  delist_pgn_node(owner->mm, vicpgn);
+#else
+  if (find_victim_page(caller->mm, &vicpgn) < 0)
+    return -1;
+#endif
+
+  if (__swap_out_page(caller, owner, vicpgn, vicfpn) < 0)
+  {
+    //No frame in all swaps, the victim stays resident
+    enlist_pgn_node(owner->mm, vicpgn);
+    *vicfpn = -1;
+  }
+
+  if (owner->mm != caller->mm)
+    mm_unlock(owner->mm);
+  if (*vicfpn < 0)
+    return -1;
+
+  if (caller->mm != NULL)
+    __atomic_fetch_add(&swap_stat.direct, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* 
+ * mm_reclaim - evict pages in the background to keep RAM frames free
+ * @kswapd : reclaimer context, it owns no pages and runs on no CPU
+ * @low    : start reclaiming when fewer frames than this are free
+ * @high   : stop once this many frames are free
+ *
+ * Return the number of frames freed.
+ */
+int mm_reclaim(struct pcb_t *kswapd, int low, int high)
+{
+  struct memphy_struct *mram = kswapd->mram;
+  int fpn, freed = 0;
+
+  if (MEMPHY_nr_freefp(mram) >= low)
+    return 0;
+
+  while (MEMPHY_nr_freefp(mram) < high && mm_evict_page(kswapd, &fpn) == 0)
+  {
+    MEMPHY_put_freefp(mram, fpn);
+    freed++;
+  }
+
+#ifdef MMDBG
+  if (freed > 0)
+    printf("kswapd: freed %d frames, %d free\n", freed, MEMPHY_nr_freefp(mram));
+#endif
+  __atomic_fetch_add(&swap_stat.background, freed, __ATOMIC_RELAXED);
+  return freed;
+}
+
+/* 
+ * __swap_in_page - bring a swapped page back into frame [fpn]
+ * The swap slot is kept as a clean copy of the page
+ */
+int __swap_in_page(struct pcb_t *caller, int pgn, int fpn)
+{
+  struct mm_struct *mm = caller->mm;
+  uint32_t *ptep = pte_walk(mm, pgn, 0);
+  uint32_t pte = *ptep;
+  int swptyp = GETVAL(pte, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
+  int swpoff = GETVAL(pte, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT);
+
+  caller->active_mswp = caller->mswp[swptyp];
+  __swap_cp_page(caller->active_mswp, swpoff, caller->mram, fpn);
+  __atomic_fetch_add(&swap_stat.swapins, 1, __ATOMIC_RELAXED);
+
+  pte_set_fpn(ptep, fpn);
+  PTE_CLRBIT(*ptep, PAGING_PTE_DIRTY_MASK);
+  PTE_SETBIT(*ptep, PAGING_PTE_ACCESSED_MASK);
+  *pte_swpcopy(mm, pgn) = PAGING_SWPCOPY(swptyp, swpoff);
+  mm_rmap(caller->mram, fpn, mm, pgn);
+
+  return 0;
+}
+
+/* 
+ * __zero_fill_page - back a reserved page with frame [fpn] on first touch
+ */
+int __zero_fill_page(struct pcb_t *caller, int pgn, int fpn)
+{
+  static const BYTE zero_page[PAGING_PAGESZ];
+  struct mm_struct *mm = caller->mm;
+  uint32_t *pte = pte_walk(mm, pgn, 0);
+
+  MEMPHY_write_frame(caller->mram, fpn, zero_page);
+  __atomic_fetch_add(&swap_stat.zerofills, 1, __ATOMIC_RELAXED);
+
+  *pte = 0;
+  pte_set_fpn(pte, fpn);
+  PTE_SETBIT(*pte, PAGING_PTE_ACCESSED_MASK);
+  *pte_swpcopy(mm, pgn) = 0;
+  mm_rmap(caller->mram, fpn, mm, pgn);
+
+  return 0;
+}
+
+/* 
+ * mm_swap_stat - print the swap traffic counters
+ */
+int mm_swap_stat(void)
+{
+  unsigned long evictions = swap_stat.swapouts + swap_stat.clean_evictions;
+
+  printf("SWAP_STAT: swap-ins %lu swap-outs %lu clean evictions %lu\n",
+         swap_stat.swapins, swap_stat.swapouts, swap_stat.clean_evictions);
+  printf("SWAP_STAT: written %lu bytes, avoided %lu bytes (%.2f%% of evictions)\n",
+         swap_stat.swapouts * PAGING_PAGESZ,
+         swap_stat.clean_evictions * PAGING_PAGESZ,
+         evictions ? 100.0 * swap_stat.clean_evictions / evictions : 0.0);
+#ifdef MM_PAGING_GLOBAL
+  printf("SWAP_STAT: victims of other processes %lu\n", swap_stat.stolen);
+#endif
+#ifdef MM_DEMAND_PAGING
+  printf("SWAP_STAT: pages backed on first touch %lu\n", swap_stat.zerofills);
+#endif
+#ifdef MM_KSWAPD
+  printf("SWAP_STAT: evictions by kswapd %lu, by faulting processes %lu (%.2f%% off the fault path)\n",
+         swap_stat.background, swap_stat.direct,
+         swap_stat.background + swap_stat.direct ?
+           100.0 * swap_stat.background / (swap_stat.background + swap_stat.direct) : 0.0);
+#endif
   return 0;
 }
 
@@ -286,22 +617,21 @@ int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
  */
 int init_mm(struct mm_struct *mm, struct pcb_t *caller)
 {
-  struct vm_area_struct * vma = malloc(sizeof(struct vm_area_struct));
+  /* Leaves come with the first page mapped in them */
+  memset(mm->pgd, 0, sizeof(mm->pgd));
 
-  mm->pgd = malloc(PAGING_MAX_PGN*sizeof(uint32_t));
+  memset(mm->vmatbl, 0, sizeof(mm->vmatbl));
+  mm->map_count = 0;
 
   /* By default the owner comes with at least one vma */
-  vma->vm_id = 0;
-  vma->vm_start = 0;
-  vma->vm_end = vma->vm_start;
-  vma->sbrk = vma->vm_start;
-  struct vm_rg_struct *first_rg = init_vm_rg(vma->vm_start, vma->vm_end);
-  enlist_vm_rg_node(&vma->vm_freerg_list, first_rg);
-
-  vma->vm_next = NULL;
-  vma->vm_mm = mm; /*point back to vma owner */
+  if (create_vm_area(mm, 0, 0, 0) == NULL)
+    return -1;
 
-  mm->mmap = vma;
+  mm->fifo_pgn = -1;
+  mm->owner = caller;
+#ifdef SYNCH
+  pthread_mutex_init(&mm->lock, NULL);
+#endif
 
   return 0;
 }
@@ -325,17 +655,73 @@ int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct* rgnode)
   return 0;
 }
 
-int enlist_pgn_node(struct pgn_t **plist, int pgn)
+/*
+ * pgn_next, pgn_prev - ring links of a page, its leaf must exist
+ */
+int *pgn_next(struct mm_struct *mm, int pgn)
+{
+  return &mm->pgd[PAGING_PGD_IDX(pgn)]->pg_next[PAGING_PTBL_IDX(pgn)];
+}
+
+int *pgn_prev(struct mm_struct *mm, int pgn)
 {
-  struct pgn_t* pnode = malloc(sizeof(struct pgn_t));
+  return &mm->pgd[PAGING_PGD_IDX(pgn)]->pg_prev[PAGING_PTBL_IDX(pgn)];
+}
+
+/*
+ * enlist_pgn_node - add a page to the resident page ring of an mm
+ * @mm  : memory region
+ * @pgn : page number, mapped
+ *
+ * The page goes right behind the hand, so it is the newest page and
+ * the last one the hand visits. A page already on the ring stays put.
+ */
+int enlist_pgn_node(struct mm_struct *mm, int pgn)
+{
+  int hand = mm->fifo_pgn;
 
-  pnode->pgn = pgn;
-  pnode->pg_next = *plist;
-  *plist = pnode;
+  if (*pgn_next(mm, pgn) != -1)
+    return 0;
+
+  if (hand == -1)
+  {
+    *pgn_next(mm, pgn) = *pgn_prev(mm, pgn) = pgn;
+    mm->fifo_pgn = pgn;
+    return 0;
+  }
+
+  *pgn_next(mm, pgn) = hand;
+  *pgn_prev(mm, pgn) = *pgn_prev(mm, hand);
+  *pgn_next(mm, *pgn_prev(mm, hand)) = pgn;
+  *pgn_prev(mm, hand) = pgn;
 
   return 0;
 }
 
+/*
+ * delist_pgn_node - unlink a page from the resident page ring of an mm,
+ * nothing to do if it is not on it
+ */
+void delist_pgn_node(struct mm_struct *mm, int pgn)
+{
+  int next, prev;
+
+  if (pte_walk(mm, pgn, 0) == NULL || (next = *pgn_next(mm, pgn)) == -1)
+    return;
+
+  prev = *pgn_prev(mm, pgn);
+  if (next == pgn)
+    mm->fifo_pgn = -1;
+  else
+  {
+    *pgn_next(mm, prev) = next;
+    *pgn_prev(mm, next) = prev;
+    if (mm->fifo_pgn == pgn)
+      mm->fifo_pgn = next;
+  }
+  *pgn_next(mm, pgn) = *pgn_prev(mm, pgn) = -1;
+}
+
 int print_list_fp(struct framephy_struct *ifp)
 {
    struct framephy_struct *fp = ifp;
@@ -368,32 +754,31 @@ int print_list_rg(struct vm_rg_struct *irg)
    return 0;
 }
 
-int print_list_vma(struct vm_area_struct *ivma)
+int print_list_vma(struct mm_struct *mm)
 {
-   struct vm_area_struct *vma = ivma;
+   int i;
  
    printf("print_list_vma: ");
-   if (vma == NULL) {printf("NULL list\n"); return -1;}
+   if (mm->map_count == 0) {printf("NULL list\n"); return -1;}
    printf("\n");
-   while (vma != NULL )
-   {
-       printf("va[%ld->%ld]\n",vma->vm_start, vma->vm_end);
-       vma = vma->vm_next;
-   }
+   for (i = 0; i < mm->map_count; i++)
+       printf("va[%ld->%ld]\n",mm->mmap[i]->vm_start, mm->mmap[i]->vm_end);
    printf("\n");
    return 0;
 }
 
-int print_list_pgn(struct pgn_t *ip)
+int print_list_pgn(struct mm_struct *mm)
 {
+   int p = mm->fifo_pgn;
+
    printf("print_list_pgn: ");
-   if (ip == NULL) {printf("NULL list\n"); return -1;}
+   if (p == -1) {printf("NULL list\n"); return -1;}
    printf("\n");
-   while (ip != NULL )
+   do
    {
-       printf("va[%d]-\n",ip->pgn);
-       ip = ip->pg_next;
-   }
+       printf("va[%d]-\n",p);
+       p = *pgn_next(mm, p);
+   } while (p != mm->fifo_pgn);
    printf("\n");
    return 0;
 }
@@ -418,7 +803,7 @@ int print_pgtbl(struct pcb_t *caller, uint32_t start, uint32_t end)
 
   for(pgit = pgn_start; pgit < pgn_end; pgit++)
   {
-     printf("%08ld: %08x\n", pgit * sizeof(uint32_t), caller->mm->pgd[pgit]);
+     printf("%08ld: %08x\n", pgit * sizeof(uint32_t), pte_get(caller->mm, pgit));
   }
 
   return 0;
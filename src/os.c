@@ -4,6 +4,9 @@
 #include "sched.h"
 #include "loader.h"
 #include "mm.h"
+#ifdef CPU_TLB
+#include "cpu-tlbcache.h"
+#endif
 
 #include <pthread.h>
 #include <stdio.h>
@@ -14,8 +17,17 @@ static int time_slot;
 static int num_cpus;
 static int done = 0;
 
+#if defined(MM_KSWAPD) && !defined(MM_PAGING_GLOBAL)
+#error "MM_KSWAPD needs MM_PAGING_GLOBAL"
+#endif
+
+#ifdef MM_KSWAPD
+static int nr_cpus_running;	// CPUs not stopped yet, kswapd leaves with the last
+#endif
+
 #ifdef CPU_TLB
 static int tlbsz;
+static int tlbpolicy = TLB_REPL_RANDOM;
 #endif
 
 #ifdef MM_PAGING
@@ -25,7 +37,6 @@ static int memswpsz[PAGING_MAX_MMSWP];
 struct mmpaging_ld_args
 {
 	/* A dispatched argument struct to compact many-fields passing to loader */
-	struct memphy_struct *tlb;
 	struct memphy_struct *mram;
 	struct memphy_struct **mswp;
 	struct memphy_struct *active_mswp;
@@ -47,132 +58,297 @@ struct cpu_args
 {
 	struct timer_id_t *timer_id;
 	int id;
+	/* Per-CPU state kept across time slots */
+	struct pcb_t *proc;
+	int time_left;
+	int stopped;
+#ifdef CPU_TLB
+	struct memphy_struct *tlb;	// Private TLB of this CPU
+#endif
 };
 
+/*
+ *  Both execution engines drive the CPUs and the loader through the
+ *  step functions below. A step does the work of one time slot and
+ *  returns the slot its device next has work in: 0 for the following
+ *  slot, a later slot, or TIMER_IDLE if it waits for other devices.
+ *  The threaded engine hands that value to next_slot_until(), the
+ *  discrete-event engine (des_run) folds it into its own clock.
+ */
+static uint64_t cpu_step(struct cpu_args *cpu)
+{
+	int id = cpu->id;
+	struct pcb_t *proc = cpu->proc;
+
+#ifdef CPU_TLB
+	/* Slot boundary, apply the shootdowns other CPUs sent us */
+	tlb_shootdown_apply(cpu->tlb);
+#endif
+
+	/* Check the status of current process */
+	if (proc == NULL)
+	{
+		/* No process is running, the we load new process from
+		 * ready queue */
+		proc = get_proc(id);
+	}
+	else if (proc->pc == proc->code->size)
+	{
+		/* The porcess has finish it job */
+		printf("\tCPU %d: Processed %2d has finished\n",
+			   id, proc->pid);
+#ifdef CPU_TLB
+		tlbexit(proc);
+#elif defined(MM_PAGING)
+		pgexit(proc);
+#endif
+		free(proc);
+		proc = get_proc(id);
+		cpu->time_left = 0;
+	}
+	else if (cpu->time_left == 0)
+	{
+		/* The process has done its job in current time slot */
+		printf("\tCPU %d: Put process %2d to run queue\n",
+			   id, proc->pid);
+#ifdef CPU_TLB
+		tlb_preempt(proc);
+#endif
+		put_proc(id, proc);
+		proc = get_proc(id);
+	}
+	cpu->proc = proc;
+
+	/* Recheck process status after loading new process */
+	if (proc == NULL && __atomic_load_n(&done, __ATOMIC_ACQUIRE))
+	{
+		/* No process to run, exit */
+		printf("\tCPU %d stopped\n", id);
+		cpu->stopped = 1;
+#ifdef MM_KSWAPD
+		__atomic_fetch_sub(&nr_cpus_running, 1, __ATOMIC_RELAXED);
+#endif
+		return TIMER_IDLE;
+	}
+	else if (proc == NULL)
+	{
+		/* There may be new processes to run in
+		 * next time slots, idle until someone makes work */
+		return TIMER_IDLE;
+	}
+	else if (cpu->time_left == 0)
+	{
+		printf("\tCPU %d: Dispatched process %2d\n",
+			   id, proc->pid);
+		cpu->time_left = time_slot;
+#ifdef CPU_TLB
+		tlb_dispatch(proc, id);
+#endif
+	}
+
+	/* Run current process */
+	run(proc);
+	cpu->time_left--;
+	return 0;
+}
+
 static void *cpu_routine(void *args)
 {
-	struct timer_id_t *timer_id = ((struct cpu_args *)args)->timer_id;
-	int id = ((struct cpu_args *)args)->id;
+	struct cpu_args *cpu = (struct cpu_args *)args;
 	/* Check for new process in ready queue */
-	int time_left = 0;
-	struct pcb_t *proc = NULL;
 	while (1)
 	{
-		/* Check the status of current process */
-		if (proc == NULL)
-		{
-			/* No process is running, the we load new process from
-			 * ready queue */
-			proc = get_proc();
-			if (proc == NULL)
-			{
-				next_slot(timer_id);
-				continue; /* First load failed. skip dummy load */
-			}
-		}
-		else if (proc->pc == proc->code->size)
-		{
-			/* The porcess has finish it job */
-			printf("\tCPU %d: Processed %2d has finished\n",
-				   id, proc->pid);
-			free(proc);
-			proc = get_proc();
-			time_left = 0;
-		}
-		else if (time_left == 0)
-		{
-			/* The process has done its job in current time slot */
-			printf("\tCPU %d: Put process %2d to run queue\n",
-				   id, proc->pid);
-			put_proc(proc);
-			proc = get_proc();
-		}
-
-		/* Recheck process status after loading new process */
-		if (proc == NULL && done)
-		{
-			/* No process to run, exit */
-			printf("\tCPU %d stopped\n", id);
+		uint64_t wake = cpu_step(cpu);
+		if (cpu->stopped)
 			break;
-		}
-		else if (proc == NULL)
-		{
-			/* There may be new processes to run in
-			 * next time slots, just skip current slot */
-			next_slot(timer_id);
-			continue;
-		}
-		else if (time_left == 0)
-		{
-			printf("\tCPU %d: Dispatched process %2d\n",
-				   id, proc->pid);
-			time_left = time_slot;
-		}
-
-		/* Run current process */
-		run(proc);
-		time_left--;
-		next_slot(timer_id);
+		next_slot_until(cpu->timer_id, wake);
 	}
-	detach_event(timer_id);
+	detach_event(cpu->timer_id);
 	pthread_exit(NULL);
 }
 
-static void *ld_routine(void *args)
+/* Loader state kept across time slots */
+static int ld_next = 0;			// Index of the next process to load
+static struct pcb_t *ld_pending = NULL;	// Loaded, waiting for its start time
+static int ld_stopped = 0;
+
+static uint64_t ld_step(void *args)
 {
 #ifdef MM_PAGING
 	struct memphy_struct* mram = ((struct mmpaging_ld_args *)args)->mram;
 	struct memphy_struct** mswp = ((struct mmpaging_ld_args *)args)->mswp;
 	struct memphy_struct* active_mswp = ((struct mmpaging_ld_args *)args)->active_mswp;
-	struct timer_id_t * timer_id = ((struct mmpaging_ld_args *)args)->timer_id;
-#else
-	struct timer_id_t *timer_id = (struct timer_id_t *)args;
-#endif
-#ifdef CPU_TLB
-	struct memphy_struct* tlb = ((struct mmpaging_ld_args *)args)->tlb;
 #endif
+	int i = ld_next;
 
+	if (i >= num_processes)
+	{
+		free(ld_processes.path);
+		free(ld_processes.start_time);
+		__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+		ld_stopped = 1;
+		return TIMER_IDLE;
+	}
 
-	int i = 0;
-	printf("ld_routine\n");
-	while (i < num_processes)
+	if (ld_pending == NULL)
 	{
-		struct pcb_t *proc = load(ld_processes.path[i]);
+		ld_pending = load(ld_processes.path[i]);
 #ifdef MLQ_SCHED
-		proc->prio = ld_processes.prio[i];
+		ld_pending->prio = ld_processes.prio[i];
 #endif
-		while (current_time() < ld_processes.start_time[i])
-		{
-			next_slot(timer_id);
-		}
+	}
+	if (current_time() < ld_processes.start_time[i])
+		return ld_processes.start_time[i];
+
+	struct pcb_t *proc = ld_pending;
+	ld_pending = NULL;
 #ifdef MM_PAGING
-		proc->mm = malloc(sizeof(struct mm_struct));
-		init_mm(proc->mm, proc);
-		proc->mram = mram;
-		proc->mswp = mswp;
-		proc->active_mswp = active_mswp;
+	proc->mm = malloc(sizeof(struct mm_struct));
+	init_mm(proc->mm, proc);
+	proc->mram = mram;
+	proc->mswp = mswp;
+	proc->active_mswp = active_mswp;
 
 #ifdef CPU_TLB
-		proc->tlb = tlb;
+	proc->tlb = NULL; // Set to the TLB of the CPU on dispatch
+	proc->tlb_gen = 0;
+	proc->tlb_cpus = 0;
+	proc->tlb_active = 0;
 #endif
 
 #endif
 
 
-		printf("\tLoaded a process at %s, PID: %d PRIO: %ld\n",
-			   ld_processes.path[i], proc->pid, ld_processes.prio[i]);
-		add_proc(proc);
-		free(ld_processes.path[i]);
-		i++;
-		next_slot(timer_id);
+	printf("\tLoaded a process at %s, PID: %d PRIO: %ld\n",
+		   ld_processes.path[i], proc->pid, ld_processes.prio[i]);
+	add_proc(proc);
+	free(ld_processes.path[i]);
+	ld_next++;
+	return 0;
+}
+
+static void *ld_routine(void *args)
+{
+#ifdef MM_PAGING
+	struct timer_id_t * timer_id = ((struct mmpaging_ld_args *)args)->timer_id;
+#else
+	struct timer_id_t *timer_id = (struct timer_id_t *)args;
+#endif
+
+	printf("ld_routine\n");
+	while (1)
+	{
+		uint64_t wake = ld_step(args);
+		if (ld_stopped)
+			break;
+		next_slot_until(timer_id, wake);
 	}
-	free(ld_processes.path);
-	free(ld_processes.start_time);
-	done = 1;
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
 
+#ifdef MM_KSWAPD
+/*
+ *  kswapd - background page reclaim device
+ *  Each slot it tops free RAM up to the high watermark once it fell
+ *  below the low one, so faulting processes find a free frame instead
+ *  of evicting a page themselves. It has no work of its own and leaves
+ *  once every CPU has stopped.
+ */
+static struct pcb_t kswapd_proc;	// Context of the evictions, owns no page
+static struct timer_id_t *kswapd_event;
+static int kswapd_low, kswapd_high;	// Watermarks in free frames
+static int kswapd_stopped = 0;
+
+static uint64_t kswapd_step(void)
+{
+	if (__atomic_load_n(&nr_cpus_running, __ATOMIC_RELAXED) == 0)
+	{
+		kswapd_stopped = 1;
+		return TIMER_IDLE;
+	}
+#ifdef CPU_TLB
+	tlbreclaim(&kswapd_proc, kswapd_low, kswapd_high);
+#else
+	mm_reclaim(&kswapd_proc, kswapd_low, kswapd_high);
+#endif
+	return TIMER_IDLE;
+}
+
+static void *kswapd_routine(void *args)
+{
+	while (1)
+	{
+		uint64_t wake = kswapd_step();
+		if (kswapd_stopped)
+			break;
+		next_slot_until(kswapd_event, wake);
+	}
+	detach_event(kswapd_event);
+	pthread_exit(NULL);
+}
+#endif
+
+/*
+ *  des_run - discrete-event execution engine
+ *  Runs the loader and every CPU from this thread, stepping them in a
+ *  fixed order (loader first, then CPU 0..N-1, then kswapd) once per
+ *  time slot.
+ *  Each slot is one legal interleaving of the threaded engine, so the
+ *  output has the same shape but is deterministic, and no thread ever
+ *  blocks on the timer.
+ */
+static void des_run(struct cpu_args *cpus, struct timer_id_t *ld_event, void *ld_args)
+{
+	int i, alive;
+
+	printf("ld_routine\n");
+	do
+	{
+		uint64_t wake = TIMER_IDLE, w;
+		alive = 0;
+
+		if (!ld_stopped)
+		{
+			w = ld_step(ld_args);
+			if (ld_stopped)
+				detach_event(ld_event);
+			else
+			{
+				alive++;
+				if (w < wake)
+					wake = w;
+			}
+		}
+		for (i = 0; i < num_cpus; i++)
+		{
+			if (cpus[i].stopped)
+				continue;
+			w = cpu_step(&cpus[i]);
+			if (cpus[i].stopped)
+				detach_event(cpus[i].timer_id);
+			else
+			{
+				alive++;
+				if (w < wake)
+					wake = w;
+			}
+		}
+#ifdef MM_KSWAPD
+		/* Never keeps the loop alive, it stops with the last CPU */
+		if (!kswapd_stopped)
+		{
+			kswapd_step();
+			if (kswapd_stopped)
+				detach_event(kswapd_event);
+		}
+#endif
+
+		if (alive)
+			advance_slot(wake);
+	} while (alive);
+}
+
 static void read_config(const char *path)
 {
 	FILE *file;
@@ -181,7 +357,26 @@ static void read_config(const char *path)
 		printf("Cannot find configure file at %s\n", path);
 		exit(1);
 	}
-	fscanf(file, "%d %d %d\n", &time_slot, &num_cpus, &num_processes);
+	/* First line:
+	 *        [time slice] [N = Number of CPU] [M = Number of Processes to be run]
+	 *        followed, with CPU_TLB, by an optional TLB replacement
+	 *        policy: random (default), lru or clock
+	 */
+	char line[256];
+	char policy[16] = "";
+	if (fgets(line, sizeof(line), file) == NULL ||
+		sscanf(line, "%d %d %d %15s", &time_slot, &num_cpus, &num_processes, policy) < 3)
+	{
+		printf("Invalid configure file at %s\n", path);
+		exit(1);
+	}
+#ifdef CPU_TLB
+	if (policy[0] != '\0' && (tlbpolicy = tlb_policy_by_name(policy)) < 0)
+	{
+		printf("Unknown TLB replacement policy %s\n", policy);
+		exit(1);
+	}
+#endif
 	ld_processes.path = (char **)malloc(sizeof(char *) * num_processes);
 	ld_processes.start_time = (unsigned long *)
 		malloc(sizeof(unsigned long) * num_processes);
@@ -250,15 +445,16 @@ static void read_config(const char *path)
 int main(int argc, char *argv[])
 {
 	/* Read config */
-	if (argc != 2)
+	int des_mode = (argc == 3 && strcmp(argv[1], "--des") == 0);
+	if (argc != 2 && !des_mode)
 	{
-		printf("Usage: os [path to configure file]\n");
+		printf("Usage: os [--des] [path to configure file]\n");
 		return 1;
 	}
 	char path[100];
 	path[0] = '\0';
 	strcat(path, "input/");
-	strcat(path, argv[1]);
+	strcat(path, argv[argc - 1]);
 	read_config(path);
 
 	pthread_t *cpu = (pthread_t *)malloc(num_cpus * sizeof(pthread_t));
@@ -272,12 +468,42 @@ int main(int argc, char *argv[])
 	{
 		args[i].timer_id = attach_event();
 		args[i].id = i;
+		args[i].proc = NULL;
+		args[i].time_left = 0;
+		args[i].stopped = 0;
 	}
 	struct timer_id_t *ld_event = attach_event();
+#ifdef MM_KSWAPD
+	kswapd_event = attach_event();
+	nr_cpus_running = num_cpus;
+#endif
 	start_timer();
 #ifdef CPU_TLB
-	struct memphy_struct tlb;
-	init_tlbmemphy(&tlb, tlbsz);
+	/* Every CPU owns a private TLB of the configured size */
+	struct memphy_struct *tlbs =
+		(struct memphy_struct *)malloc(sizeof(struct memphy_struct) * num_cpus);
+	for (i = 0; i < num_cpus; i++)
+	{
+		init_tlbmemphy(&tlbs[i], tlbsz);
+		tlb_set_policy(&tlbs[i], tlbpolicy);
+		args[i].tlb = &tlbs[i];
+	}
+#ifdef CPUTLB_L1_SZ
+	/* A small L1 in front of each of them, which then acts as L2.
+	 * Both levels replace entries with the configured policy */
+	struct memphy_struct *l1tlbs =
+		(struct memphy_struct *)malloc(sizeof(struct memphy_struct) * num_cpus);
+	for (i = 0; i < num_cpus; i++)
+	{
+		init_tlbmemphy(&l1tlbs[i], CPUTLB_L1_SZ * sizeof(TLB_entry_t));
+		tlb_set_policy(&l1tlbs[i], tlbpolicy);
+		l1tlbs[i].tlbl2 = &tlbs[i];
+		args[i].tlb = &l1tlbs[i];
+	}
+	tlb_init_cpus(l1tlbs, num_cpus);
+#else
+	tlb_init_cpus(tlbs, num_cpus);
+#endif
 #endif
 
 #ifdef MM_PAGING
@@ -286,57 +512,133 @@ int main(int argc, char *argv[])
 
 	struct memphy_struct mram;
 	struct memphy_struct mswp[PAGING_MAX_MMSWP];
+	struct memphy_struct *mswp_list[PAGING_MAX_MMSWP];
 
 	/* Create MEM RAM */
 	init_memphy(&mram, memramsz, rdmflag);
+#ifdef MM_PAGING_GLOBAL
+	MEMPHY_init_rmap(&mram);
+#endif
 
 	/* Create all MEM SWAP */
+#ifdef MM_SEQ_SWAP
+	rdmflag = 0;
+#endif
 	int sit;
 	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+	{
 		init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+		mswp_list[sit] = &mswp[sit];
+	}
 
 	/* In Paging mode, it needs passing the system mem to each PCB through loader*/
 	struct mmpaging_ld_args *mm_ld_args = malloc(sizeof(struct mmpaging_ld_args));
 
 	mm_ld_args->timer_id = ld_event;
 	mm_ld_args->mram = (struct memphy_struct *)&mram;
-	mm_ld_args->mswp = (struct memphy_struct **)mswp;
+	mm_ld_args->mswp = mswp_list;
 	mm_ld_args->active_mswp = (struct memphy_struct *)&mswp[0];
-#endif
 
-#ifdef CPU_TLB
-#ifdef MM_PAGING
-	/* In MM_PAGING employ CPU_TLB mode, it needs passing
-	 * the system tlb to each PCB through loader
-	 */
-	mm_ld_args->tlb = (struct memphy_struct *)&tlb;
+#ifdef MM_KSWAPD
+	kswapd_proc.mram = &mram;
+	kswapd_proc.mswp = mswp_list;
+	kswapd_proc.active_mswp = &mswp[0];
+	kswapd_low = mram.fpcount * MM_KSWAPD_LOW / 100;
+	kswapd_high = mram.fpcount * MM_KSWAPD_HIGH / 100;
+	if (kswapd_low < 1)
+		kswapd_low = 1;
+	if (kswapd_high < kswapd_low)
+		kswapd_high = kswapd_low;
 #endif
 #endif
 
 	/* Init scheduler */
-	init_scheduler();
+	init_scheduler(num_cpus);
 
-	/* Run CPU and loader */
 #ifdef MM_PAGING
-	pthread_create(&ld, NULL, ld_routine, (void *)mm_ld_args);
+	void *ld_args = (void *)mm_ld_args;
 #else
-	pthread_create(&ld, NULL, ld_routine, (void *)ld_event);
+	void *ld_args = (void *)ld_event;
 #endif
-	for (i = 0; i < num_cpus; i++)
+
+	if (des_mode)
 	{
-		pthread_create(&cpu[i], NULL,
-					   cpu_routine, (void *)&args[i]);
+		/* Run CPU and loader as state machines of one event loop */
+		des_run(args, ld_event, ld_args);
 	}
-
-	/* Wait for CPU and loader finishing */
-	for (i = 0; i < num_cpus; i++)
+	else
 	{
-		pthread_join(cpu[i], NULL);
+		/* Run CPU and loader */
+		pthread_create(&ld, NULL, ld_routine, ld_args);
+#ifdef MM_KSWAPD
+		pthread_t kswapd;
+		pthread_create(&kswapd, NULL, kswapd_routine, NULL);
+#endif
+		for (i = 0; i < num_cpus; i++)
+		{
+			pthread_create(&cpu[i], NULL,
+						   cpu_routine, (void *)&args[i]);
+		}
+
+		/* Wait for CPU and loader finishing */
+		for (i = 0; i < num_cpus; i++)
+		{
+			pthread_join(cpu[i], NULL);
+		}
+		pthread_join(ld, NULL);
+#ifdef MM_KSWAPD
+		pthread_join(kswapd, NULL);
+#endif
 	}
-	pthread_join(ld, NULL);
 
 	/* Stop timer */
 	stop_timer();
 
+	finish_scheduler();
+
+#if defined(CPU_TLB) && defined(STAT_DUMP)
+	for (i = 0; i < num_cpus; i++)
+	{
+		printf("CPU %d ", i);
+		tlb_cache_stat(args[i].tlb);
+	}
+#endif
+
+#if defined(MM_PAGING) && defined(STAT_DUMP)
+	mm_swap_stat();
+	MEMPHY_frame_stat(&mram, "RAM");
+#endif
+
+#ifdef MM_SEQ_SWAP
+	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+	{
+		char name[16];
+		snprintf(name, sizeof(name), "SWAP %d", sit);
+		MEMPHY_seek_stat(&mswp[sit], name);
+	}
+#endif
+
+#ifdef MM_PAGING
+	free_memphy(&mram);
+	for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+		free_memphy(&mswp[sit]);
+	free(mm_ld_args);
+#endif
+
+#ifdef CPU_TLB
+	tlb_free_cpus();
+	for (i = 0; i < num_cpus; i++)
+	{
+		free_tlbmemphy(&tlbs[i]);
+#ifdef CPUTLB_L1_SZ
+		free_tlbmemphy(&l1tlbs[i]);
+#endif
+	}
+	free(tlbs);
+#ifdef CPUTLB_L1_SZ
+	free(l1tlbs);
+#endif
+#endif
+
 	return 0;
 }
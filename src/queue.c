@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include "queue.h"
 
+/* Slot of the [i]-th process counted from the head of [q] */
+#define QUEUE_AT(q, i) ((q)->proc[((q)->head + (i)) & ((q)->capacity - 1)])
+
 void print_queue(struct queue_t *q, int check)
 {
         if (q == NULL)
@@ -18,7 +21,7 @@ void print_queue(struct queue_t *q, int check)
         }
         for (int i = 0; i < q->size; i++)
         {
-                printf("Process ID: %d\n", q->proc[i]->pid);
+                printf("Process ID: %d\n", QUEUE_AT(q, i)->pid);
         }
 }
 // Check if queue is empty or not
@@ -32,23 +35,39 @@ int empty(struct queue_t *q)
         return (q->size == 0);
 }
 
+/* Double the capacity of [q], unwrapping its content to index 0 */
+static int grow_queue(struct queue_t *q)
+{
+        int newcap = (q->capacity == 0) ? QUEUE_INIT_SIZE : q->capacity * 2;
+        struct pcb_t **newproc = (struct pcb_t **)malloc(sizeof(struct pcb_t *) * newcap);
+        if (newproc == NULL)
+        {
+                return -1;
+        }
+        for (int i = 0; i < q->size; i++)
+        {
+                newproc[i] = QUEUE_AT(q, i);
+        }
+        free(q->proc);
+        q->proc = newproc;
+        q->head = 0;
+        q->capacity = newcap;
+        return 0;
+}
+
 void enqueue(struct queue_t *q, struct pcb_t *proc)
 {
         /* TODO: put a new process to queue [q] */
-        // Find the correct position to insert the new process based on its priority
-        // print_queue(q, 1);
         if (q == NULL)
         {
                 return; // q is not initialized
-                perror("Queue is null !\n");
-                exit(1);
         }
-        if (q->size == MAX_QUEUE_SIZE)
+        if (q->size == q->capacity && grow_queue(q) != 0)
         {
-                perror("Queue is full\n"); // queue [q] is full, cannot put more process
+                perror("Queue is full\n"); // cannot get more room for [q]
                 exit(1);
         }
-        q->proc[q->size] = proc;
+        QUEUE_AT(q, q->size) = proc;
         q->size = q->size + 1;
 }
 struct pcb_t *dequeue(struct queue_t *q)
@@ -61,36 +80,56 @@ struct pcb_t *dequeue(struct queue_t *q)
         {
                 return NULL; // q is not initialized or q is empty, cannot remove process
         }
-        struct pcb_t *temp = q->proc[0]; // Get the first process in queue
-        // print_queue(q, 1);
 #ifdef MLQ_SCHED
-        for (int i = 0; i < q->size - 1; i++)
-        {
-                q->proc[i] = q->proc[i + 1];
-        }
-        q->proc[q->size - 1] = NULL;
+        /* Every process of a MLQ level shares the same priority, pop the head */
+        struct pcb_t *temp = QUEUE_AT(q, 0);
+        QUEUE_AT(q, 0) = NULL;
+        q->head = (q->head + 1) & (q->capacity - 1);
         q->size = q->size - 1;
-        // print_queue(q, 2);
         return temp;
 #else
         int index = 0;
         for (int i = 1; i < q->size; i++)
         {
-                if (q->proc[i]->priority < q->proc[index]->priority)
+                if (QUEUE_AT(q, i)->priority < QUEUE_AT(q, index)->priority)
                 {
                         index = i;
                 }
         }
-        struct pcb_t *remove_process = q->proc[index]; // Get the process with highest priority
+        struct pcb_t *remove_process = QUEUE_AT(q, index); // Get the process with highest priority
 
-        // Remove that process, push all processes after that up 1 position
-        for (int i = index; i < q->size - 1; i++)
+        // Close the gap from whichever end is nearer, keeping FIFO order
+        if (index < q->size - 1 - index)
         {
-                q->proc[i] = q->proc[i + 1];
+                for (int i = index; i > 0; i--)
+                {
+                        QUEUE_AT(q, i) = QUEUE_AT(q, i - 1);
+                }
+                QUEUE_AT(q, 0) = NULL;
+                q->head = (q->head + 1) & (q->capacity - 1);
+        }
+        else
+        {
+                for (int i = index; i < q->size - 1; i++)
+                {
+                        QUEUE_AT(q, i) = QUEUE_AT(q, i + 1);
+                }
+                QUEUE_AT(q, q->size - 1) = NULL;
         }
-        q->proc[q->size - 1] = NULL;
         q->size = q->size - 1;
-        // print_queue(q, 2);
         return remove_process;
 #endif
 }
+
+void free_queue(struct queue_t *q)
+{
+        if (q == NULL)
+        {
+                return;
+        }
+        free(q->proc);
+        q->proc = NULL;
+        q->head = 0;
+        q->size = 0;
+        q->capacity = 0;
+}
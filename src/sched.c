@@ -12,149 +12,304 @@ static pthread_mutex_t queue_lock;
 #endif
 
 #ifdef MLQ_SCHED
-static struct queue_t mlq_ready_queue[MAX_PRIO];
-int slot[MAX_PRIO];
+/*
+ *  O(1) MLQ dispatcher
+ *  bitmap holds one bit per priority level whose queue is non-empty
+ *  and still has slot budget left in the current epoch, so the next
+ *  level to serve is a find-first-set over MLQ_BITMAP_WORDS words.
+ *  nonempty tracks non-empty levels regardless of their budget.
+ *  When every non-empty level has used up its budget we start a new
+ *  epoch: slots are refilled lazily (slot_epoch[prio] != epoch means
+ *  the level still owns a full budget of MAX_PRIO - prio slots) and the
+ *  ready bitmap is reloaded from nonempty.
+ *
+ *  Every CPU owns one such run queue. A CPU puts its preempted process
+ *  back on its own queue, the loader places new processes on the least
+ *  loaded queue and an idle CPU steals from the busiest peer, taking
+ *  the peer's lowest priority work first.
+ */
+#define MLQ_BITMAP_WORDS ((MAX_PRIO + 63) / 64)
+
+struct mlq_rq {
+	struct queue_t queue[MAX_PRIO];
+	int slot[MAX_PRIO];
+	unsigned long slot_epoch[MAX_PRIO];
+	unsigned long epoch;
+	uint64_t bitmap[MLQ_BITMAP_WORDS];
+	uint64_t nonempty[MLQ_BITMAP_WORDS];
+	int nr_queued;	// Read without the lock to pick add/steal targets
+#ifdef SYNCH
+	pthread_mutex_t lock;
+#endif
+};
+
+static struct mlq_rq *mlq_rqs;
+static int nr_rqs;
+
+static inline void mlq_set_bit(uint64_t *map, int prio)
+{
+	map[prio / 64] |= 1ULL << (prio % 64);
+}
+
+static inline void mlq_clear_bit(uint64_t *map, int prio)
+{
+	map[prio / 64] &= ~(1ULL << (prio % 64));
+}
+
+static inline int mlq_find_first_bit(const uint64_t *map)
+{
+	int w;
+	for (w = 0; w < MLQ_BITMAP_WORDS; w++)
+		if (map[w])
+			return w * 64 + __builtin_ctzll(map[w]);
+	return -1;
+}
+
+static inline int mlq_find_last_bit(const uint64_t *map)
+{
+	int w;
+	for (w = MLQ_BITMAP_WORDS - 1; w >= 0; w--)
+		if (map[w])
+			return w * 64 + 63 - __builtin_clzll(map[w]);
+	return -1;
+}
+
+static inline int mlq_nr_queued(struct mlq_rq *rq)
+{
+	return __atomic_load_n(&rq->nr_queued, __ATOMIC_RELAXED);
+}
 #endif
 
 int queue_empty(void)
 {
 #ifdef MLQ_SCHED
-	unsigned long prio;
-	for (prio = 0; prio < MAX_PRIO; prio++)
-		if (!empty(&mlq_ready_queue[prio]))
-			return -1;
+	int i;
+	for (i = 0; i < nr_rqs; i++)
+		if (mlq_nr_queued(&mlq_rqs[i]) > 0)
+			return 0;
 #endif
 	return (empty(&ready_queue) && empty(&run_queue));
 }
 
-void init_scheduler(void)
+void init_scheduler(int num_cpus)
 {
 #ifdef MLQ_SCHED
-	int i;
+	int i, cpu;
 
-	for (i = 0; i < MAX_PRIO; i++)
+	nr_rqs = (num_cpus > 0) ? num_cpus : 1;
+	mlq_rqs = (struct mlq_rq *)calloc(nr_rqs, sizeof(struct mlq_rq));
+	for (cpu = 0; cpu < nr_rqs; cpu++)
 	{
-		mlq_ready_queue[i].size = 0;
-		slot[i] = MAX_PRIO - i;
+		for (i = 0; i < MAX_PRIO; i++)
+			mlq_rqs[cpu].slot[i] = MAX_PRIO - i;
+#ifdef SYNCH
+		pthread_mutex_init(&mlq_rqs[cpu].lock, NULL);
+#endif
 	}
 #endif
-	ready_queue.size = 0;
-	run_queue.size = 0;
+	ready_queue.head = ready_queue.size = 0;
+	run_queue.head = run_queue.size = 0;
 #ifdef SYNCH
 	pthread_mutex_init(&queue_lock, NULL);
 #endif
 }
 
+void finish_scheduler(void)
+{
 #ifdef MLQ_SCHED
-/*
- *  Stateful design for routine calling
- *  based on the priority and our MLQ policy
- *  We implement stateful here using transition technique
- *  State representation   prio = 0 .. MAX_PRIO, curr_slot = 0..(MAX_PRIO - prio)
- */
-void set_slot_for_queue()
+	int i, cpu;
+
+	for (cpu = 0; cpu < nr_rqs; cpu++)
+	{
+		for (i = 0; i < MAX_PRIO; i++)
+			free_queue(&mlq_rqs[cpu].queue[i]);
+#ifdef SYNCH
+		pthread_mutex_destroy(&mlq_rqs[cpu].lock);
+#endif
+	}
+	free(mlq_rqs);
+	mlq_rqs = NULL;
+	nr_rqs = 0;
+#endif
+	free_queue(&ready_queue);
+	free_queue(&run_queue);
+#ifdef SYNCH
+	pthread_mutex_destroy(&queue_lock);
+#endif
+}
+
+#ifdef MLQ_SCHED
+static inline void mlq_lock(struct mlq_rq *rq)
 {
 #ifdef SYNCH
-    pthread_mutex_lock(&queue_lock);
+	pthread_mutex_lock(&rq->lock);
 #endif
-	for (int i = 0; i < MAX_PRIO; i++)
-		slot[i] = MAX_PRIO - i;
+}
+
+static inline void mlq_unlock(struct mlq_rq *rq)
+{
 #ifdef SYNCH
-    pthread_mutex_unlock(&queue_lock);
+	pthread_mutex_unlock(&rq->lock);
 #endif
 }
-int check_new_process(int i)
+
+/* Slot budget left for [prio] in the current epoch of [rq] */
+static inline int *mlq_slot(struct mlq_rq *rq, int prio)
 {
-	for (int j = 0; j < i; j++)
+	if (rq->slot_epoch[prio] != rq->epoch)
 	{
-		if (empty(&mlq_ready_queue[j]) || slot[j] <= 0)
-			continue;
-		return j - 1;
+		rq->slot_epoch[prio] = rq->epoch;
+		rq->slot[prio] = MAX_PRIO - prio;
 	}
-	return -2;
+	return &rq->slot[prio];
 }
-struct pcb_t *get_mlq_proc(void)
+
+/* Refill every level's budget, callers must hold rq->lock */
+static void mlq_refill_epoch(struct mlq_rq *rq)
+{
+	int w;
+	rq->epoch++;
+	for (w = 0; w < MLQ_BITMAP_WORDS; w++)
+		rq->bitmap[w] = rq->nonempty[w];
+}
+
+/* Enqueue [proc] to its level and publish it, callers must hold rq->lock */
+static void mlq_enqueue(struct mlq_rq *rq, struct pcb_t *proc)
+{
+	int prio = proc->prio;
+
+	enqueue(&rq->queue[prio], proc);
+	mlq_set_bit(rq->nonempty, prio);
+	if (*mlq_slot(rq, prio) > 0)
+		mlq_set_bit(rq->bitmap, prio);
+	__atomic_store_n(&rq->nr_queued, rq->nr_queued + 1, __ATOMIC_RELAXED);
+}
+
+/* Pop the head of level [prio] and keep the bitmaps in step,
+ * callers must hold rq->lock */
+static struct pcb_t *mlq_dequeue(struct mlq_rq *rq, int prio)
+{
+	struct pcb_t *proc = dequeue(&rq->queue[prio]);
+
+	if (empty(&rq->queue[prio]))
+	{
+		mlq_clear_bit(rq->nonempty, prio);
+		mlq_clear_bit(rq->bitmap, prio);
+	}
+	__atomic_store_n(&rq->nr_queued, rq->nr_queued - 1, __ATOMIC_RELAXED);
+	return proc;
+}
+
+/* Charge one slot of [prio] to [rq] */
+static void mlq_charge_slot(struct mlq_rq *rq, int prio)
+{
+	int *budget = mlq_slot(rq, prio);
+
+	(*budget)--;
+	if (*budget <= 0)
+		mlq_clear_bit(rq->bitmap, prio);
+}
+
+/* Take the lowest priority process of the busiest peer of [cpu] */
+static struct pcb_t *mlq_steal(int cpu)
 {
 	struct pcb_t *proc = NULL;
-	/*TODO: get a process from PRIORITY [ready_queue].
-	 * Remember to use lock to protect the queue.
-	 */
-	int check = 0;
-	int flag = 0;
-	for (int i = 0; i < MAX_PRIO; ++i)
+	struct mlq_rq *busiest = NULL;
+	int i, nr, max_nr = 0;
+
+	for (i = 1; i < nr_rqs; i++)
 	{
-		check = check_new_process(i);
-		if (check != -2)
+		struct mlq_rq *rq = &mlq_rqs[(cpu + i) % nr_rqs];
+		nr = mlq_nr_queued(rq);
+		if (nr > max_nr)
 		{
-			i = check;
-			continue;
+			max_nr = nr;
+			busiest = rq;
 		}
+	}
+	if (busiest == NULL)
+		return NULL;
 
-		if (empty(&mlq_ready_queue[i]))
-		{
-			if (flag == 1 && i == MAX_PRIO - 1)
-			{
-				flag = 0;
-				set_slot_for_queue();
-				i = -1;
-			}
-			continue;
-		}
-		if (slot[i] <= 0)
-		{
-			flag = 1;
-			if (i == MAX_PRIO - 1)
-			{
-				flag = 0;
-				set_slot_for_queue();
-				i = -1;
-			}
-			continue;
-		}
-#ifdef SYNCH
-        pthread_mutex_lock(&queue_lock);
-#endif
-		proc = dequeue(&mlq_ready_queue[i]);
-		slot[i]--;
-#ifdef SYNCH
-		pthread_mutex_unlock(&queue_lock);
-#endif
-		break;
+	mlq_lock(busiest);
+	int prio = mlq_find_last_bit(busiest->nonempty);
+	if (prio >= 0)
+		proc = mlq_dequeue(busiest, prio);
+	mlq_unlock(busiest);
+
+	return proc;
+}
+
+struct pcb_t *get_mlq_proc(int cpu)
+{
+	struct mlq_rq *rq = &mlq_rqs[cpu % nr_rqs];
+	struct pcb_t *proc = NULL;
+	int prio;
+
+	mlq_lock(rq);
+	prio = mlq_find_first_bit(rq->bitmap);
+	if (prio < 0 && mlq_find_first_bit(rq->nonempty) >= 0)
+	{
+		/* All waiting levels are out of budget, start a new epoch */
+		mlq_refill_epoch(rq);
+		prio = mlq_find_first_bit(rq->bitmap);
+	}
+
+	if (prio >= 0)
+	{
+		proc = mlq_dequeue(rq, prio);
+		mlq_charge_slot(rq, prio);
+	}
+	mlq_unlock(rq);
+
+	if (proc == NULL && (proc = mlq_steal(cpu)) != NULL)
+	{
+		/* The thief dispatches it, so the slot comes from its budget */
+		mlq_lock(rq);
+		mlq_charge_slot(rq, proc->prio);
+		mlq_unlock(rq);
 	}
 
 	return proc;
 }
 
-void put_mlq_proc(struct pcb_t *proc)
+void put_mlq_proc(int cpu, struct pcb_t *proc)
 {
-#ifdef SYNCH
-    pthread_mutex_lock(&queue_lock);
-#endif
-	enqueue(&mlq_ready_queue[proc->prio], proc);
-#ifdef SYNCH
-    pthread_mutex_unlock(&queue_lock);
-#endif
+	struct mlq_rq *rq = &mlq_rqs[cpu % nr_rqs];
+
+	mlq_lock(rq);
+	mlq_enqueue(rq, proc);
+	mlq_unlock(rq);
 }
 
 void add_mlq_proc(struct pcb_t *proc)
 {
-#ifdef SYNCH
-	pthread_mutex_lock(&queue_lock);
-#endif
-	enqueue(&mlq_ready_queue[proc->prio], proc);
-#ifdef SYNCH
-	pthread_mutex_unlock(&queue_lock);
-#endif
+	struct mlq_rq *rq = &mlq_rqs[0];
+	int i, nr, min_nr = mlq_nr_queued(rq);
+
+	/* New processes go to the least loaded run queue */
+	for (i = 1; i < nr_rqs && min_nr > 0; i++)
+	{
+		nr = mlq_nr_queued(&mlq_rqs[i]);
+		if (nr < min_nr)
+		{
+			min_nr = nr;
+			rq = &mlq_rqs[i];
+		}
+	}
+
+	mlq_lock(rq);
+	mlq_enqueue(rq, proc);
+	mlq_unlock(rq);
 }
 
-struct pcb_t *get_proc(void)
+struct pcb_t *get_proc(int cpu)
 {
-	return get_mlq_proc();
+	return get_mlq_proc(cpu);
 }
 
-void put_proc(struct pcb_t *proc)
+void put_proc(int cpu, struct pcb_t *proc)
 {
-	return put_mlq_proc(proc);
+	return put_mlq_proc(cpu, proc);
 }
 
 void add_proc(struct pcb_t *proc)
@@ -162,7 +317,7 @@ void add_proc(struct pcb_t *proc)
 	return add_mlq_proc(proc);
 }
 #else
-struct pcb_t *get_proc(void)
+struct pcb_t *get_proc(int cpu)
 {
 	struct pcb_t *proc = NULL;
 	/*TODO: get a process from [ready_queue].
@@ -180,7 +335,7 @@ struct pcb_t *get_proc(void)
 	return proc;
 }
 
-void put_proc(struct pcb_t *proc)
+void put_proc(int cpu, struct pcb_t *proc)
 {
 	pthread_mutex_lock(&queue_lock);
 	enqueue(&run_queue, proc);
@@ -193,4 +348,4 @@ void add_proc(struct pcb_t *proc)
 	enqueue(&ready_queue, proc);
 	pthread_mutex_unlock(&queue_lock);
 }
-#endif
\ No newline at end of file
+#endif
@@ -3,8 +3,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-static pthread_t _timer;
-
+/*
+ * Global tick engine
+ * All attached devices meet at one generation-counted barrier. Each
+ * device calling next_slot() arrives at the barrier of the current
+ * slot; the last one to arrive (or the last pending device detaching)
+ * advances the time, bumps the generation and wakes everybody with a
+ * single broadcast, so a slot costs one collective synchronization
+ * instead of two lock/condvar handshakes per device.
+ *
+ * With IDLE_FASTFWD each arrival also carries the earliest slot in
+ * which the device has work again. If no device is busy in the next
+ * slot the timer jumps straight to the earliest of these, so arrival
+ * gaps in the workload cost one barrier instead of one per slot.
+ */
 struct timer_id_container_t {
 	struct timer_id_t id;
 	struct timer_id_container_t * next;
@@ -15,81 +27,86 @@ static struct timer_id_container_t * dev_list = NULL;
 static uint64_t _time;
 
 static int timer_started = 0;
-static int timer_stop = 0;
-
 
-static void * timer_routine(void * args) {
-	while (!timer_stop) {
-		printf("Time slot %3lu\n", current_time());
-		int fsh = 0;
-		int event = 0;
-		/* Wait for all devices have done the job in current
-		 * time slot */
-		struct timer_id_container_t * temp;
-		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.event_lock);
-			while (!temp->id.done && !temp->id.fsh) {
-				pthread_cond_wait(
-					&temp->id.event_cond,
-					&temp->id.event_lock
-				);
-			}
-			if (temp->id.fsh) {
-				fsh++;
-			}
-			event++;
-			pthread_mutex_unlock(&temp->id.event_lock);
-		}
-
-		/* Increase the time slot */
-		_time++;
-		
-		/* Let devices continue their job */
-		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.timer_lock);
-			temp->id.done = 0;
-			pthread_cond_signal(&temp->id.timer_cond);
-			pthread_mutex_unlock(&temp->id.timer_lock);
-		}
-		if (fsh == event) {
-			break;
-		}
+static pthread_mutex_t tick_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tick_cond = PTHREAD_COND_INITIALIZER;
+static int nr_devs = 0;		// Devices attached and not yet detached
+static int nr_arrived = 0;	// Devices waiting at the current barrier
+static uint64_t generation = 0;
+static uint64_t min_wake = TIMER_IDLE;	// Earliest wake-up of the arrived devices
+
+/* Move to the next slot and release the barrier,
+ * callers must hold tick_lock */
+static void timer_tick(void) {
+	nr_arrived = 0;
+#ifdef IDLE_FASTFWD
+	if (min_wake != TIMER_IDLE && min_wake > _time + 1) {
+		_time = min_wake - 1;
+	}
+#endif
+	min_wake = TIMER_IDLE;
+	_time++;
+	generation++;
+	if (nr_devs > 0) {
+		printf("Time slot %3lu\n", _time);
 	}
-	pthread_exit(args);
+	pthread_cond_broadcast(&tick_cond);
 }
 
 void next_slot(struct timer_id_t * timer_id) {
+	next_slot_until(timer_id, 0);
+}
+
+void next_slot_until(struct timer_id_t * timer_id, uint64_t wake) {
+	pthread_mutex_lock(&tick_lock);
 	/* Tell to timer that we have done our job in current slot */
-	pthread_mutex_lock(&timer_id->event_lock);
 	timer_id->done = 1;
-	pthread_cond_signal(&timer_id->event_cond);
-	pthread_mutex_unlock(&timer_id->event_lock);
+	if (wake < min_wake) {
+		min_wake = wake;
+	}
+	if (++nr_arrived == nr_devs) {
+		timer_tick();
+	} else {
+		/* Wait for going to next slot */
+		uint64_t gen = generation;
+		while (gen == generation) {
+			pthread_cond_wait(&tick_cond, &tick_lock);
+		}
+	}
+	timer_id->done = 0;
+	pthread_mutex_unlock(&tick_lock);
+}
 
-	/* Wait for going to next slot */
-	pthread_mutex_lock(&timer_id->timer_lock);
-	while (timer_id->done) {
-		pthread_cond_wait(
-			&timer_id->timer_cond,
-			&timer_id->timer_lock
-		);
+void advance_slot(uint64_t wake) {
+	pthread_mutex_lock(&tick_lock);
+	if (wake < min_wake) {
+		min_wake = wake;
 	}
-	pthread_mutex_unlock(&timer_id->timer_lock);
+	timer_tick();
+	pthread_mutex_unlock(&tick_lock);
 }
 
 uint64_t current_time() {
-	return _time;
+	pthread_mutex_lock(&tick_lock);
+	uint64_t now = _time;
+	pthread_mutex_unlock(&tick_lock);
+	return now;
 }
 
 void start_timer() {
 	timer_started = 1;
-	pthread_create(&_timer, NULL, timer_routine, NULL);
+	printf("Time slot %3lu\n", current_time());
 }
 
 void detach_event(struct timer_id_t * event) {
-	pthread_mutex_lock(&event->event_lock);
+	pthread_mutex_lock(&tick_lock);
 	event->fsh = 1;
-	pthread_cond_signal(&event->event_cond);
-	pthread_mutex_unlock(&event->event_lock);
+	nr_devs--;
+	/* The remaining devices may all be waiting on us */
+	if (nr_devs == 0 || nr_arrived == nr_devs) {
+		timer_tick();
+	}
+	pthread_mutex_unlock(&tick_lock);
 }
 
 struct timer_id_t * attach_event() {
@@ -102,10 +119,9 @@ struct timer_id_t * attach_event() {
 			);
 		container->id.done = 0;
 		container->id.fsh = 0;
-		pthread_cond_init(&container->id.event_cond, NULL);
-		pthread_mutex_init(&container->id.event_lock, NULL);
-		pthread_cond_init(&container->id.timer_cond, NULL);
-		pthread_mutex_init(&container->id.timer_lock, NULL);
+		pthread_mutex_lock(&tick_lock);
+		nr_devs++;
+		pthread_mutex_unlock(&tick_lock);
 		if (dev_list == NULL) {
 			dev_list = container;
 			dev_list->next = NULL;
@@ -118,19 +134,15 @@ struct timer_id_t * attach_event() {
 }
 
 void stop_timer() {
-	timer_stop = 1;
-	pthread_join(_timer, NULL);
+	/* Wait for every device to detach */
+	pthread_mutex_lock(&tick_lock);
+	while (nr_devs > 0) {
+		pthread_cond_wait(&tick_cond, &tick_lock);
+	}
+	pthread_mutex_unlock(&tick_lock);
 	while (dev_list != NULL) {
 		struct timer_id_container_t * temp = dev_list;
 		dev_list = dev_list->next;
-		pthread_cond_destroy(&temp->id.event_cond);
-		pthread_mutex_destroy(&temp->id.event_lock);
-		pthread_cond_destroy(&temp->id.timer_cond);
-		pthread_mutex_destroy(&temp->id.timer_lock);
 		free(temp);
 	}
 }
-
-
-
-